@@ -0,0 +1,209 @@
+/* CHIP-8 STATIC ANALYZER
+ *
+ * Disassembles an image from 0x200, following jumps, calls and skips, and
+ * prints its basic blocks with their instructions, the data they use and
+ * the bytes that are never reached.
+ *
+ * With -g, it prints the control-flow graph in Graphviz format instead.
+ * With -w, it also writes the analysis next to the image ("<file>.cfg"),
+ * where the frontends pick it up to decode the program at load time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "instr.h"
+
+/* Write the mnemonic of "opcode" to "buf". */
+static void disassemble(uint16_t opcode, char *buf, size_t size) {
+    instr_t in;
+    cpu_decode(opcode, &in);
+    int x = in.x, y = in.y, nn = in.nn, n = in.n, nnn = in.nnn;
+    switch (in.id) {
+        case OP_00E0: snprintf(buf, size, "CLS"); break;
+        case OP_00EE: snprintf(buf, size, "RET"); break;
+        case OP_1NNN: snprintf(buf, size, "JP   %03x", nnn); break;
+        case OP_2NNN: snprintf(buf, size, "CALL %03x", nnn); break;
+        case OP_3XNN: snprintf(buf, size, "SE   V%X, %02x", x, nn); break;
+        case OP_4XNN: snprintf(buf, size, "SNE  V%X, %02x", x, nn); break;
+        case OP_5XY0: snprintf(buf, size, "SE   V%X, V%X", x, y); break;
+        case OP_6XNN: snprintf(buf, size, "LD   V%X, %02x", x, nn); break;
+        case OP_7XNN: snprintf(buf, size, "ADD  V%X, %02x", x, nn); break;
+        case OP_8XY0: snprintf(buf, size, "LD   V%X, V%X", x, y); break;
+        case OP_8XY1: snprintf(buf, size, "OR   V%X, V%X", x, y); break;
+        case OP_8XY2: snprintf(buf, size, "AND  V%X, V%X", x, y); break;
+        case OP_8XY3: snprintf(buf, size, "XOR  V%X, V%X", x, y); break;
+        case OP_8XY4: snprintf(buf, size, "ADD  V%X, V%X", x, y); break;
+        case OP_8XY5: snprintf(buf, size, "SUB  V%X, V%X", x, y); break;
+        case OP_8XY6: snprintf(buf, size, "SHR  V%X", x); break;
+        case OP_8XY7: snprintf(buf, size, "SUBN V%X, V%X", x, y); break;
+        case OP_8XYE: snprintf(buf, size, "SHL  V%X", x); break;
+        case OP_9XY0: snprintf(buf, size, "SNE  V%X, V%X", x, y); break;
+        case OP_ANNN: snprintf(buf, size, "LD   I, %03x", nnn); break;
+        case OP_BNNN: snprintf(buf, size, "JP   V0, %03x", nnn); break;
+        case OP_CXNN: snprintf(buf, size, "RND  V%X, %02x", x, nn); break;
+        case OP_DXYN: snprintf(buf, size, "DRW  V%X, V%X, %X", x, y, n); break;
+        case OP_EX9E: snprintf(buf, size, "SKP  V%X", x); break;
+        case OP_EXA1: snprintf(buf, size, "SKNP V%X", x); break;
+        case OP_FX07: snprintf(buf, size, "LD   V%X, DT", x); break;
+        case OP_FX0A: snprintf(buf, size, "LD   V%X, K", x); break;
+        case OP_FX15: snprintf(buf, size, "LD   DT, V%X", x); break;
+        case OP_FX18: snprintf(buf, size, "LD   ST, V%X", x); break;
+        case OP_FX1E: snprintf(buf, size, "ADD  I, V%X", x); break;
+        case OP_FX29: snprintf(buf, size, "LD   F, V%X", x); break;
+        case OP_FX33: snprintf(buf, size, "LD   B, V%X", x); break;
+        case OP_FX55: snprintf(buf, size, "LD   [I], V%X", x); break;
+        case OP_FX65: snprintf(buf, size, "LD   V%X, [I]", x); break;
+        default:      snprintf(buf, size, "???"); break;
+    }
+}
+
+/* Print a run of "n" bytes from "address", up to 8 per line. */
+static void print_bytes(chip8_t *c, const char *kind, uint32_t address, uint32_t n) {
+    printf("\n%s %03x-%03x\n", kind, address, address + n);
+    while (n > 0) {
+        uint32_t k, line = n < 8 ? n : 8;
+        printf("    %03x  ", address);
+        for (k = 0; k < line; k++)
+            printf(" %02x", c->memory[address + k]);
+        printf("\n");
+        address += line;
+        n -= line;
+    }
+}
+
+/* Listing: blocks and data in address order, then what was not reached. */
+static void print_listing(chip8_t *c, cfg_t *g, uint32_t end) {
+    int i, k, ninstr = 0;
+    uint32_t a, ndata = 0, nunknown = 0;
+    for (i = 0; i < g->nblocks; i++)
+        ninstr += (g->blocks[i].end - g->blocks[i].start) / 2;
+    for (a = 0x200; a < end; a++) {
+        if ((g->map[a] & (CFG_CODE | CFG_DATA)) == CFG_DATA)
+            ndata++;
+        else if (!(g->map[a] & (CFG_CODE | CFG_DATA)))
+            nunknown++;
+    }
+    printf("%d blocks, %d instructions, %u data bytes, %u bytes not reached\n",
+            g->nblocks, ninstr, ndata, nunknown);
+
+    a = 0x200;
+    i = 0;
+    while (a < end || i < g->nblocks) {
+        /* Blocks before the image (in the font area, say) come first. */
+        if (i < g->nblocks && g->blocks[i].start <= a) {
+            cfg_block_t *b = &g->blocks[i++];
+            printf("\nblock %03x-%03x %s", b->start, b->end, cfg_kinds[b->kind]);
+            for (k = 0; k < b->nsucc; k++)
+                printf(" %s%03x", k ? "" : "-> ", b->succ[k]);
+            printf("\n");
+            uint32_t p;
+            for (p = b->start; p < b->end; p += 2) {
+                char text[32];
+                uint16_t opcode = cpu_fetch(c, p);
+                disassemble(opcode, text, sizeof(text));
+                printf("    %03x   %04x  %s\n", p, opcode, text);
+            }
+            if (b->end > a)
+                a = b->end;
+            continue;
+        }
+        if (a >= end) {
+            a = g->blocks[i].start;
+            continue;
+        }
+
+        /* Data and unreached bytes, up to the next block or kind change. */
+        uint8_t kind = g->map[a] & (CFG_CODE | CFG_DATA);
+        uint32_t stop = i < g->nblocks && g->blocks[i].start < end ?
+            g->blocks[i].start : end;
+        uint32_t n = 1;
+        while (a + n < stop && (g->map[a + n] & (CFG_CODE | CFG_DATA)) == kind)
+            n++;
+        if (!(kind & CFG_CODE))
+            print_bytes(c, kind ? "data" : "unknown", a, n);
+        a += n;
+    }
+}
+
+/* Control-flow graph in Graphviz format. */
+static void print_graph(cfg_t *g, const char *name) {
+    printf("digraph \"%s\" {\n", name);
+    printf("    node [shape=box, fontname=monospace];\n");
+    int i, k;
+    for (i = 0; i < g->nblocks; i++) {
+        cfg_block_t *b = &g->blocks[i];
+        printf("    b%03x [label=\"%03x-%03x\\n%s\"];\n", b->start, b->start,
+                b->end, cfg_kinds[b->kind]);
+        for (k = 0; k < b->nsucc; k++) {
+            /* Skips: the first edge is the skip not taken. */
+            const char *style = b->kind == BLOCK_SKIP && k == 1 ?
+                " [style=dashed]" : "";
+            printf("    b%03x -> b%03x%s;\n", b->start, b->succ[k], style);
+        }
+    }
+    printf("}\n");
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-analyze [-g] [-w] file\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int graph = 0, write = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "gw")) != -1) {
+        switch (opt) {
+            case 'g': graph = 1; break;
+            case 'w': write = 1; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    const char *path = argv[optind];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "chip8: error opening file (%s)\n", path);
+        exit(1);
+    }
+    static chip8_t chip8;
+    chip8_t *c = &chip8;
+    cpu_reset(c);
+    uint8_t rom[sizeof(c->memory) - 0x200 + 1];
+    size_t size = fread(rom, 1, sizeof(rom), file);
+    fclose(file);
+    if (cpu_load(c, rom, size) < 0) {
+        fprintf(stderr, "chip8: image file too large (%s)\n", path);
+        exit(1);
+    }
+
+    cfg_t g;
+    if (cfg_build(&g, c) < 0) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+    if (graph)
+        print_graph(&g, path);
+    else
+        print_listing(c, &g, 0x200 + size);
+
+    if (write) {
+        char out[4096];
+        snprintf(out, sizeof(out), "%s.cfg", path);
+        FILE *f = fopen(out, "w");
+        if (!f || cfg_save(&g, f) < 0) {
+            fprintf(stderr, "chip8: error writing analysis (%s)\n", out);
+            exit(1);
+        }
+        fclose(f);
+    }
+
+    cfg_free(&g);
+    cpu_release(c);
+    return 0;
+}
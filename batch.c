@@ -0,0 +1,394 @@
+/* CHIP-8 BATCH RUNNER
+ *
+ * Runs a list of jobs (image x input script x seed) on all cores.
+ * Each job runs uncapped: timers tick once every "cycles" instructions
+ * of emulated time, never on wall time.
+ *
+ * Job list: one job per line, blank lines and lines starting with '#'
+ * are ignored.
+ *
+ *      <image> <script|-> <seed> <frames>
+ *
+ * Input script: one event per line, "<frame> <keys>", where keys is a
+ * hexadecimal bitmask (bit k set = key k pressed). The mask holds from
+ * that frame on, until the next event.
+ *
+ * With -a, images are taken from a corpus archive (see chip8-pack)
+ * instead of the file system: <image> is a name packed in the archive, or
+ * "@<hash>" to pick an image by content. The archive is mapped once and
+ * every job loads straight from it.
+ *
+ * Jobs are dealt round-robin to one deque per worker. A worker pops jobs
+ * from the bottom of its own deque; once it is empty, it steals from the
+ * top of the other workers' deques, so a few long jobs never leave the
+ * other cores idle. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "chip8.h"
+
+/* Why a job stopped. */
+enum {
+    EXIT_FRAMES,    /* ran all of its frames */
+    EXIT_HALT,      /* reached a jump to itself */
+    EXIT_FAULT,     /* stuck on an instruction it cannot run */
+    EXIT_ERROR      /* image or script could not be loaded */
+};
+
+static const char *exit_reason[] = { "frames", "halt", "fault", "error" };
+
+/* Input script event: from "frame" on, the keys in "mask" are pressed. */
+typedef struct {
+    int      frame;
+    uint16_t mask;
+} event_t;
+
+/* Files are loaded once and shared (read-only) by every job using them. */
+typedef struct {
+    char     *path;
+    const uint8_t *data;
+    size_t    size;
+    event_t  *events;
+    int       nevents;
+    int       ok;
+} file_t;
+
+typedef struct {
+    file_t   *rom;
+    file_t   *script;   /* NULL if the job has no input */
+    uint32_t  seed;
+    int       frames;
+
+    /* results */
+    uint64_t  hash;
+    long      cycles;
+    int       reason;
+} job_t;
+
+/* Per-worker deque of job indices. */
+typedef struct {
+    pthread_mutex_t lock;
+    int  *jobs;
+    int   top;      /* thieves take from here */
+    int   bottom;   /* the owner takes from here */
+} deque_t;
+
+static job_t   *jobs;
+static int      njobs;
+static deque_t *deques;
+static chip8_t *machines;   /* one per worker */
+static int      nworkers;
+static int      cycles_per_frame = 10;
+static int      engine = ENGINE_CALL;
+
+static file_t  *files;
+static int      nfiles;
+
+/* Archive images are taken from, if any. */
+static corpus_t *corpus;
+
+static void out_of_memory() {
+    fprintf(stderr, "chip8: out of memory\n");
+    exit(1);
+}
+
+/* Read the whole file at "path" into a newly allocated buffer. */
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    size_t cap = 4096, n = 0;
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL)
+        out_of_memory();
+    size_t r;
+    while ((r = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += r;
+        if (n == cap && (buf = realloc(buf, cap *= 2)) == NULL)
+            out_of_memory();
+    }
+    fclose(f);
+    *size = n;
+    return buf;
+}
+
+/* Parse an input script; the buffer is NUL-terminated by the caller. */
+static void parse_script(file_t *f, char *text) {
+    char *line = text;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        int frame;
+        unsigned mask;
+        if (line[0] != '#' && sscanf(line, "%d %x", &frame, &mask) == 2) {
+            f->events = realloc(f->events, (f->nevents + 1) * sizeof(event_t));
+            if (f->events == NULL)
+                out_of_memory();
+            f->events[f->nevents].frame = frame;
+            f->events[f->nevents].mask = mask;
+            f->nevents++;
+        }
+        line = next;
+    }
+}
+
+/* Return the already loaded file at "path", loading it if needed. */
+static file_t *get_file(const char *path, int script) {
+    int i;
+    for (i = 0; i < nfiles; i++)
+        if (strcmp(files[i].path, path) == 0)
+            return &files[i];
+
+    files = realloc(files, (nfiles + 1) * sizeof(file_t));
+    if (files == NULL)
+        out_of_memory();
+    file_t *f = &files[nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    if (f->path == NULL)
+        out_of_memory();
+    if (!script && corpus) {
+        unsigned long long hash;
+        if (path[0] == '@' && sscanf(path + 1, "%llx", &hash) == 1)
+            f->data = corpus_find(corpus, hash, &f->size);
+        else
+            f->data = corpus_lookup(corpus, path, &f->size);
+        f->ok = f->data != NULL;
+        if (!f->ok)
+            fprintf(stderr, "chip8: image not in archive (%s)\n", path);
+        return f;
+    }
+
+    uint8_t *data = read_file(path, &f->size);
+    f->ok = data != NULL;
+    if (!f->ok) {
+        fprintf(stderr, "chip8: error opening file (%s)\n", path);
+    } else if (script) {
+        data = realloc(data, f->size + 1);
+        if (data == NULL)
+            out_of_memory();
+        data[f->size] = '\0';
+        parse_script(f, (char *)data);
+    }
+    f->data = data;
+    return f;
+}
+
+static void load_jobs(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "chip8: error opening job list (%s)\n", path);
+        exit(1);
+    }
+    /* Files are referenced by index while parsing since "files" may move. */
+    int *rom_idx = NULL, *script_idx = NULL;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char rom[512], script[512];
+        unsigned seed;
+        int frames;
+        if (line[0] == '#' || sscanf(line, "%511s %511s %u %d",
+                    rom, script, &seed, &frames) != 4)
+            continue;
+
+        jobs = realloc(jobs, (njobs + 1) * sizeof(job_t));
+        rom_idx = realloc(rom_idx, (njobs + 1) * sizeof(int));
+        script_idx = realloc(script_idx, (njobs + 1) * sizeof(int));
+        if (jobs == NULL || rom_idx == NULL || script_idx == NULL)
+            out_of_memory();
+        job_t *j = &jobs[njobs];
+        memset(j, 0, sizeof(*j));
+        j->seed = seed;
+        j->frames = frames;
+        file_t *fr = get_file(rom, 0);
+        rom_idx[njobs] = fr - files;
+        script_idx[njobs] = -1;
+        if (strcmp(script, "-") != 0) {
+            file_t *fs = get_file(script, 1);
+            script_idx[njobs] = fs - files;
+        }
+        njobs++;
+    }
+    fclose(f);
+
+    int i;
+    for (i = 0; i < njobs; i++) {
+        jobs[i].rom = &files[rom_idx[i]];
+        jobs[i].script = script_idx[i] >= 0 ? &files[script_idx[i]] : NULL;
+    }
+    free(rom_idx);
+    free(script_idx);
+}
+
+/* Run a single job to completion on machine "c". */
+static void run_job(chip8_t *c, job_t *j) {
+    if (!j->rom->ok || (j->script && !j->script->ok)) {
+        j->reason = EXIT_ERROR;
+        return;
+    }
+    cpu_reset(c);
+    cpu_seed(c, j->seed);
+    if (cpu_load(c, j->rom->data, j->rom->size) < 0) {
+        j->reason = EXIT_ERROR;
+        return;
+    }
+
+    int next = 0;   /* next script event */
+    int frame;
+    j->reason = EXIT_FRAMES;
+    for (frame = 0; frame < j->frames; frame++) {
+        if (j->script) {
+            file_t *s = j->script;
+            while (next < s->nevents && s->events[next].frame <= frame) {
+                int k;
+                for (k = 0; k < 16; k++)
+                    c->keys[k] = (s->events[next].mask >> k) & 1;
+                next++;
+            }
+        }
+        cpu_tick_timers(c);
+        cpu_update(c, cycles_per_frame);
+        j->cycles += cycles_per_frame;
+
+        /* Nothing will ever change again once the program jumps to itself;
+         * no point in burning the rest of the frames. */
+        if (cpu_halted(c)) {
+            j->reason = EXIT_HALT;
+            break;
+        }
+        if (c->fault) {
+            j->reason = EXIT_FAULT;
+            break;
+        }
+    }
+    j->hash = cpu_hash(c);
+}
+
+/* Take a job from the bottom of our own deque. */
+static int pop_job(deque_t *d) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+        job = d->jobs[--d->bottom];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+/* Take a job from the top of somebody else's deque. */
+static int steal_job(deque_t *d) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+        job = d->jobs[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static void *worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    chip8_t *c = &machines[id];
+
+    for (;;) {
+        int job = pop_job(&deques[id]);
+        /* Own deque is empty: try the others, starting from our neighbour.
+         * Jobs are never added after start, so once every deque is empty
+         * there is nothing left to do. */
+        int i;
+        for (i = 1; job < 0 && i < nworkers; i++)
+            job = steal_job(&deques[(id + i) % nworkers]);
+        if (job < 0)
+            break;
+        run_job(c, &jobs[job]);
+    }
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-batch [-j threads] [-e engine] [-c cycles] "
+            "[-a archive] jobfile\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    char *archive = NULL;
+    while ((opt = getopt(argc, argv, "j:e:c:a:")) != -1) {
+        switch (opt) {
+            case 'j': nworkers = atoi(optarg); break;
+            case 'e':
+                engine = cpu_engine(optarg);
+                if (engine < 0)
+                    usage();
+                break;
+            case 'c': cycles_per_frame = atoi(optarg); break;
+            case 'a': archive = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+    if (nworkers < 1)
+        nworkers = 1;
+
+    if (archive) {
+        corpus = corpus_open(archive);
+        if (!corpus) {
+            fprintf(stderr, "chip8: invalid archive (%s)\n", archive);
+            exit(1);
+        }
+    }
+    load_jobs(argv[optind]);
+
+    /* Deal the jobs round-robin to the workers, each with a machine of
+     * its own. */
+    deques = calloc(nworkers, sizeof(deque_t));
+    machines = calloc(nworkers, sizeof(chip8_t));
+    if (deques == NULL || machines == NULL)
+        out_of_memory();
+    int i;
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].jobs = malloc((njobs / nworkers + 1) * sizeof(int));
+        if (deques[i].jobs == NULL)
+            out_of_memory();
+        machines[i].engine = engine;
+    }
+    for (i = 0; i < njobs; i++) {
+        deque_t *d = &deques[i % nworkers];
+        d->jobs[d->bottom++] = i;
+    }
+
+    double start = time_getseconds();
+    pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+    if (threads == NULL)
+        out_of_memory();
+    for (i = 0; i < nworkers; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = time_getseconds() - start;
+    for (i = 0; i < nworkers; i++)
+        cpu_release(&machines[i]);
+
+    /* Per-job results, in job list order. */
+    long total = 0;
+    for (i = 0; i < njobs; i++) {
+        job_t *j = &jobs[i];
+        printf("%d\t%s\t%s\t%u\t%016llx\t%ld\t%s\n", i, j->rom->path,
+                j->script ? j->script->path : "-", j->seed,
+                (unsigned long long)j->hash, j->cycles, exit_reason[j->reason]);
+        total += j->cycles;
+    }
+    fprintf(stderr, "%d jobs, %d threads, %ld instructions in %.3fs: "
+            "%.2f MIPS, %.1f jobs/s\n", njobs, nworkers, total, elapsed,
+            total / elapsed / 1e6, njobs / elapsed);
+    return 0;
+}
@@ -0,0 +1,299 @@
+/* CHIP-8 BENCHMARK
+ *
+ * Runs a fixed corpus for a fixed number of instructions and reports how
+ * long an instruction takes. Every run uses the same seed and the same
+ * scripted input, so two runs of the same build execute exactly the same
+ * instructions and their final states hash the same.
+ *
+ * The corpus has one synthetic kernel per opcode class, built here: a
+ * long loop made only of instructions of that class (plus the jump that
+ * closes the loop). Images given on the command line are run as whole
+ * programs.
+ *
+ * Each kernel and image is run several times; the report has the mean
+ * time per instruction, its standard deviation and the best run.
+ *
+ * Idle loops are skipped as the emulator does (see cpu_idle), and the
+ * turns skipped count as instructions run; with -i, or with -l, every
+ * instruction really runs. The report says which.
+ *
+ * With -l, every run steps that many machines in lockstep instead (all
+ * with the same seed and input), and times are per instruction of a
+ * single machine; the hash is the first machine's, which must match the
+ * one of a plain run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define SEED        0x5eed1234
+#define MAX_RUNS    100
+
+/* Instructions in the body of a synthetic loop. */
+#define KERNEL_LEN  64
+
+typedef struct {
+    const char *name;
+    uint8_t     rom[0x1000 - 0x200];
+    size_t      size;
+} image_t;
+
+static int  cycles_per_frame = 10;
+static long instructions = 20000000;
+static int  runs = 10;
+static int  engine = ENGINE_CALL;
+static int  lanes = 0;
+static int  idle_off = 0;
+
+/* Append opcode "op" to image "img". */
+static void emit(image_t *img, uint16_t op) {
+    img->rom[img->size++] = op >> 8;
+    img->rom[img->size++] = op & 0xFF;
+}
+
+/* Close the loop started at address "loop". */
+static void emit_loop_end(image_t *img, uint16_t loop) {
+    emit(img, 0x1000 | loop);
+}
+
+/* 8XYN: every variant, over registers V0 to V7. */
+static void kernel_alu(image_t *img) {
+    static const uint8_t variants[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+    int i;
+    for (i = 0; i < 8; i++)
+        emit(img, 0x6000 | (i << 8) | (i * 37 + 11));
+    uint16_t loop = 0x200 + img->size;
+    for (i = 0; i < KERNEL_LEN; i++) {
+        int x = i % 8, y = (i * 3 + 1) % 8;
+        emit(img, 0x8000 | (x << 8) | (y << 4) | variants[i % 9]);
+    }
+    emit_loop_end(img, loop);
+}
+
+/* DXYN: 5-line font sprites at positions spread over the screen, some of
+ * them crossing the edges. */
+static void kernel_draw(image_t *img) {
+    int i;
+    for (i = 0; i < 8; i++)
+        emit(img, 0x6000 | (i << 8) | ((i * 29 + 3) & 0x3F));
+    emit(img, 0xA000 | (FONT + 5 * 8));     /* I = sprite "8" */
+    uint16_t loop = 0x200 + img->size;
+    for (i = 0; i < KERNEL_LEN; i++) {
+        int x = i % 8, y = (i / 8) % 8;
+        emit(img, 0xD000 | (x << 8) | (y << 4) | 5);
+    }
+    emit_loop_end(img, loop);
+}
+
+/* Branches: skips taken and not taken, and subroutine calls. A taken
+ * skip never runs the instruction after it, so those slots hold another
+ * skip that is only there to be skipped. */
+static void kernel_branch(image_t *img) {
+    emit(img, 0x6000);                      /* V0 = 0 */
+    emit(img, 0x6101);                      /* V1 = 1 */
+    uint16_t loop = 0x200 + img->size;
+    /* The subroutine sits right after the loop. */
+    uint16_t sub = loop + 2 * (KERNEL_LEN + 1);
+    int i;
+    for (i = 0; i < KERNEL_LEN; i++) {
+        switch (i % 8) {
+            case 0: emit(img, 0x3001); break;       /* not taken */
+            case 1: emit(img, 0x4000); break;       /* not taken */
+            case 2: emit(img, 0x5010); break;       /* not taken */
+            case 3: emit(img, 0x2000 | sub); break; /* call */
+            case 4: emit(img, 0x9010); break;       /* skip taken */
+            case 5: emit(img, 0x3000); break;       /* skipped */
+            case 6: emit(img, 0x4001); break;       /* skip taken */
+            case 7: emit(img, 0x3100); break;       /* skipped */
+        }
+    }
+    emit_loop_end(img, loop);
+    emit(img, 0x00EE);
+}
+
+/* FX memory ops: BCD, register store and load, I arithmetic; the data
+ * area is far from the code, so stores never hit it. */
+static void kernel_mem(image_t *img) {
+    int i;
+    for (i = 0; i < 8; i++)
+        emit(img, 0x6000 | (i << 8) | (i * 53 + 7));
+    uint16_t loop = 0x200 + img->size;
+    for (i = 0; i < KERNEL_LEN; i++) {
+        int x = i % 8;
+        switch (i % 8) {
+            case 0: emit(img, 0xA800); break;
+            case 1: emit(img, 0xF033 | (x << 8)); break;
+            case 2: emit(img, 0xF01E | (x << 8)); break;
+            case 3: emit(img, 0xF055 | (x << 8)); break;
+            case 4: emit(img, 0xA900); break;
+            case 5: emit(img, 0xF065 | (x << 8)); break;
+            case 6: emit(img, 0xF029 | (x << 8)); break;
+            case 7: emit(img, 0xF01E | (x << 8)); break;
+        }
+    }
+    emit_loop_end(img, loop);
+}
+
+/* Scripted input: a fixed pseudo-random set of keys, changed every 8
+ * frames, as a bitmask. */
+static uint16_t script_keys(long frame) {
+    uint32_t r = (uint32_t)(frame / 8) * 2654435761u + 1;
+    r ^= r >> 15;
+    return r & (r >> 16);
+}
+
+/* Run "img" for the configured number of instructions; return the time
+ * it took, and the final state hash in "hash". */
+static double run(chip8_t *c, const image_t *img, uint64_t *hash) {
+    cpu_reset(c);
+    cpu_seed(c, SEED);
+    cpu_load(c, img->rom, img->size);
+    c->idle_off = idle_off;
+
+    long frames = instructions / cycles_per_frame;
+    long frame;
+    double start = time_getseconds();
+    for (frame = 0; frame < frames; frame++) {
+        uint16_t mask = script_keys(frame);
+        int k;
+        for (k = 0; k < 16; k++)
+            c->keys[k] = (mask >> k) & 1;
+        cpu_tick_timers(c);
+        cpu_update(c, cycles_per_frame);
+    }
+    double elapsed = time_getseconds() - start;
+    *hash = cpu_hash(c);
+    return elapsed;
+}
+
+/* Same as run, on "lanes" machines in lockstep. */
+static double run_lockstep(lockstep_t *g, const image_t *img, uint64_t *hash) {
+    lockstep_load(g, img->rom, img->size);
+    int i;
+    for (i = 0; i < lanes; i++)
+        lockstep_seed(g, i, SEED);
+
+    long frames = instructions / cycles_per_frame;
+    long frame;
+    double start = time_getseconds();
+    for (frame = 0; frame < frames; frame++) {
+        uint16_t mask = script_keys(frame);
+        for (i = 0; i < lanes; i++)
+            lockstep_keys(g, i, mask);
+        lockstep_tick_timers(g);
+        lockstep_update(g, cycles_per_frame);
+    }
+    double elapsed = time_getseconds() - start;
+    *hash = cpu_hash(lockstep_machine(g, 0));
+    return elapsed / lanes;
+}
+
+static void report(chip8_t *c, lockstep_t *g, const image_t *img) {
+    double ns[MAX_RUNS];
+    double sum = 0, best = 0;
+    uint64_t hash, first = 0;
+    long executed = instructions / cycles_per_frame * cycles_per_frame;
+    int i;
+    for (i = 0; i < runs; i++) {
+        double t = g ? run_lockstep(g, img, &hash) : run(c, img, &hash);
+        ns[i] = t * 1e9 / executed;
+        sum += ns[i];
+        if (i == 0 || ns[i] < best)
+            best = ns[i];
+        if (i == 0)
+            first = hash;
+        else if (hash != first)
+            fprintf(stderr, "chip8: %s is not reproducible\n", img->name);
+    }
+    double mean = sum / runs;
+    double var = 0;
+    for (i = 0; i < runs; i++)
+        var += (ns[i] - mean) * (ns[i] - mean);
+    double stddev = runs > 1 ? sqrt(var / (runs - 1)) : 0;
+
+    printf("%-24s %9.3f %9.3f %9.3f %9.2f  %016llx\n", img->name, mean,
+            stddev, best, 1e3 / mean, (unsigned long long)first);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-bench [-e engine] [-i] [-l lanes] [-c cycles] "
+            "[-n instructions] [-r runs] [file...]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "e:il:c:n:r:")) != -1) {
+        switch (opt) {
+            case 'e':
+                engine = cpu_engine(optarg);
+                if (engine < 0)
+                    usage();
+                break;
+            case 'i': idle_off = 1; break;
+            case 'l': lanes = atoi(optarg); break;
+            case 'c': cycles_per_frame = atoi(optarg); break;
+            case 'n': instructions = atol(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (cycles_per_frame < 1 || instructions < cycles_per_frame ||
+            runs < 1 || runs > MAX_RUNS || lanes < 0)
+        usage();
+
+    chip8_t *c = calloc(1, sizeof(chip8_t));
+    lockstep_t *g = lanes > 0 ? lockstep_create(lanes) : NULL;
+    if (c == NULL || (lanes > 0 && g == NULL)) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+    c->engine = engine;
+
+    if (idle_off || g)
+        printf("idle loops: run\n");
+    else
+        printf("idle loops: skipped, turns skipped counted as run\n");
+    printf("%-24s %9s %9s %9s %9s  %s\n", "image", "ns/instr", "stddev",
+            "best", "MIPS", "hash");
+
+    static const struct {
+        const char *name;
+        void (*build)(image_t *img);
+    } kernels[] = {
+        { "alu (8XYN)",      kernel_alu },
+        { "draw (DXYN)",     kernel_draw },
+        { "branch (skip/call)", kernel_branch },
+        { "mem (FX33/55/65/1E)", kernel_mem },
+    };
+    static image_t img;
+    int i;
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        memset(&img, 0, sizeof(img));
+        img.name = kernels[i].name;
+        kernels[i].build(&img);
+        report(c, g, &img);
+    }
+
+    for (i = optind; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (!file) {
+            fprintf(stderr, "chip8: error opening file (%s)\n", argv[i]);
+            exit(1);
+        }
+        memset(&img, 0, sizeof(img));
+        img.name = argv[i];
+        img.size = fread(img.rom, 1, sizeof(img.rom), file);
+        fclose(file);
+        report(c, g, &img);
+    }
+
+    lockstep_free(g);
+    cpu_release(c);
+    free(c);
+    return 0;
+}
@@ -0,0 +1,335 @@
+/* Static analysis: the control-flow graph of an image.
+ *
+ * Code is found the way the machine would find it: decoding with
+ * cpu_decode from 0x200 and following every 1NNN and 2NNN target, every
+ * return site and both sides of every skip. Whatever is never reached
+ * that way is not code. Bytes read or written through I right after an
+ * ANNN (sprites drawn by DXYN, FX33/FX55/FX65 buffers) are data.
+ *
+ * Reached code is then cut into basic blocks: a block starts at 0x200,
+ * at a jump or call target, or right after a call or a skip, and ends at
+ * the next instruction that changes PC. Computed jumps (BNNN) cannot be
+ * followed; their blocks simply have no successors.
+ *
+ * The result can be saved next to the image and loaded back, so that the
+ * runtime decodes (and with the JIT engine, translates) every block as
+ * soon as the image is loaded instead of on first execution.
+ *
+ * Analysis file (text):
+ *
+ *      chip8-cfg 1
+ *      image <hash of memory 0x200-0xFFF>
+ *      block <start> <end> <kind> [<successor>...]
+ *      ...
+ *      data <start> <end>
+ *      ...
+ *
+ * Ranges are [start, end), addresses and hashes hexadecimal. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "instr.h"
+
+#define CFG_VERSION     1
+
+/* How blocks end, as written to analysis files. */
+const char *cfg_kinds[NBLOCK_KINDS] = {
+    [BLOCK_FALL]     = "fall",
+    [BLOCK_JUMP]     = "jump",
+    [BLOCK_CALL]     = "call",
+    [BLOCK_RETURN]   = "return",
+    [BLOCK_SKIP]     = "skip",
+    [BLOCK_INDIRECT] = "indirect",
+    [BLOCK_HALT]     = "halt",
+    [BLOCK_STOP]     = "stop",
+};
+
+/* Hash of the loaded image, to catch analyses of another one. */
+static uint64_t image_hash(chip8_t *c) {
+    return hash_bytes(&c->memory[0x200], sizeof(c->memory) - 0x200);
+}
+
+/* Return -1 if there is no memory for the block. */
+static int add_block(cfg_t *g, const cfg_block_t *b) {
+    if (g->nblocks == g->capacity) {
+        int capacity = g->capacity ? 2 * g->capacity : 64;
+        cfg_block_t *blocks = realloc(g->blocks, capacity * sizeof(cfg_block_t));
+        if (blocks == NULL)
+            return -1;
+        g->blocks = blocks;
+        g->capacity = capacity;
+    }
+    g->blocks[g->nblocks++] = *b;
+    return 0;
+}
+
+/* Mark "n" bytes from "address" as data, wrapping like I does. */
+static void mark_data(cfg_t *g, uint16_t address, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        g->map[(address + i) & 0xFFF] |= CFG_DATA;
+}
+
+/* Make "address" a block start, and queue it to be walked. */
+static void add_leader(cfg_t *g, uint16_t *queue, int *n, uint32_t address) {
+    if (address > 0xFFE || (g->map[address] & CFG_LEADER))
+        return;
+    g->map[address] |= CFG_LEADER;
+    queue[(*n)++] = address;
+}
+
+/* Decode straight-line code from "address" until it leaves, marking
+ * instructions and data and queueing the other addresses it can go to. */
+static void walk(cfg_t *g, chip8_t *c, uint16_t address, uint16_t *queue, int *n) {
+    /* Value of I, while it is known: only right after ANNN. */
+    int i_reg = -1;
+    uint32_t a = address;
+    while (a <= 0xFFE && !(g->map[a] & CFG_INSTR)) {
+        instr_t in;
+        cpu_decode(cpu_fetch(c, a), &in);
+        if (in.id == OP_INVALID)
+            return;
+        g->map[a] |= CFG_INSTR | CFG_CODE;
+        g->map[a + 1] |= CFG_CODE;
+        uint32_t next = a + 2;
+
+        switch (in.id) {
+            case OP_1NNN:
+                add_leader(g, queue, n, in.nnn);
+                return;
+            case OP_00EE:
+            case OP_BNNN:
+                return;
+            case OP_2NNN:
+                /* The subroutine may leave anything in I. */
+                add_leader(g, queue, n, in.nnn);
+                add_leader(g, queue, n, next);
+                i_reg = -1;
+                break;
+            case OP_3XNN: case OP_4XNN: case OP_5XY0: case OP_9XY0:
+            case OP_EX9E: case OP_EXA1:
+                add_leader(g, queue, n, next);
+                add_leader(g, queue, n, next + 2);
+                break;
+            case OP_ANNN:
+                i_reg = in.nnn;
+                break;
+            case OP_DXYN:
+                if (i_reg >= 0)
+                    mark_data(g, i_reg, in.n);
+                break;
+            case OP_FX33:
+                if (i_reg >= 0)
+                    mark_data(g, i_reg, 3);
+                break;
+            case OP_FX55:
+            case OP_FX65:
+                if (i_reg >= 0) {
+                    mark_data(g, i_reg, in.x + 1);
+                    i_reg = (i_reg + in.x + 1) & 0xFFFF;
+                }
+                break;
+            case OP_FX1E:
+            case OP_FX29:
+                i_reg = -1;
+                break;
+        }
+        a = next;
+    }
+}
+
+/* Cut the block starting at "start", a leader holding an instruction.
+ * Return -1 if there is no memory for it. */
+static int build_block(cfg_t *g, chip8_t *c, uint16_t start) {
+    cfg_block_t b = { .start = start };
+    uint32_t a = start;
+    for (;;) {
+        instr_t in;
+        cpu_decode(cpu_fetch(c, a), &in);
+        uint32_t next = a + 2;
+        switch (in.id) {
+            case OP_1NNN:
+                b.kind = in.nnn == a ? BLOCK_HALT : BLOCK_JUMP;
+                b.succ[b.nsucc++] = in.nnn;
+                break;
+            case OP_2NNN:
+                b.kind = BLOCK_CALL;
+                b.succ[b.nsucc++] = in.nnn;
+                if (next <= 0xFFE)
+                    b.succ[b.nsucc++] = next;
+                break;
+            case OP_00EE:
+                b.kind = BLOCK_RETURN;
+                break;
+            case OP_BNNN:
+                b.kind = BLOCK_INDIRECT;
+                break;
+            case OP_3XNN: case OP_4XNN: case OP_5XY0: case OP_9XY0:
+            case OP_EX9E: case OP_EXA1:
+                b.kind = BLOCK_SKIP;
+                if (next <= 0xFFE)
+                    b.succ[b.nsucc++] = next;
+                if (next + 2 <= 0xFFE)
+                    b.succ[b.nsucc++] = next + 2;
+                break;
+            default:
+                /* Straight-line: the block goes on unless another one
+                 * starts right after, or the code stops. */
+                if (next > 0xFFE || !(g->map[next] & CFG_INSTR)) {
+                    b.kind = BLOCK_STOP;
+                } else if (g->map[next] & CFG_LEADER) {
+                    b.kind = BLOCK_FALL;
+                    b.succ[b.nsucc++] = next;
+                } else {
+                    a = next;
+                    continue;
+                }
+                break;
+        }
+        b.end = next;
+        return add_block(g, &b);
+    }
+}
+
+/* Analyze the image loaded on "c".
+ * Return 0 on success or -1 if there is no memory for the blocks. */
+int cfg_build(cfg_t *g, chip8_t *c) {
+    memset(g, 0, sizeof(*g));
+    g->image = image_hash(c);
+
+    /* Every leader is queued once, so the queue never holds more than one
+     * entry per address. */
+    uint16_t queue[0x1000];
+    int n = 0;
+    add_leader(g, queue, &n, 0x200);
+    while (n > 0)
+        walk(g, c, queue[--n], queue, &n);
+
+    int a;
+    for (a = 0; a <= 0xFFE; a++)
+        if ((g->map[a] & (CFG_LEADER | CFG_INSTR)) == (CFG_LEADER | CFG_INSTR) &&
+                build_block(g, c, a) < 0) {
+            cfg_free(g);
+            return -1;
+        }
+    return 0;
+}
+
+void cfg_free(cfg_t *g) {
+    free(g->blocks);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Find the block starting at "address"; NULL if there is none. */
+cfg_block_t *cfg_find(cfg_t *g, uint16_t address) {
+    int lo = 0, hi = g->nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (g->blocks[mid].start < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < g->nblocks && g->blocks[lo].start == address ?
+        &g->blocks[lo] : NULL;
+}
+
+int cfg_save(cfg_t *g, FILE *f) {
+    fprintf(f, "chip8-cfg %d\n", CFG_VERSION);
+    fprintf(f, "image %016llx\n", (unsigned long long)g->image);
+    int i, k;
+    for (i = 0; i < g->nblocks; i++) {
+        cfg_block_t *b = &g->blocks[i];
+        fprintf(f, "block %03x %03x %s", b->start, b->end, cfg_kinds[b->kind]);
+        for (k = 0; k < b->nsucc; k++)
+            fprintf(f, " %03x", b->succ[k]);
+        fprintf(f, "\n");
+    }
+    uint32_t a = 0;
+    while (a < 0x1000) {
+        if (!(g->map[a] & CFG_DATA)) {
+            a++;
+            continue;
+        }
+        uint32_t start = a;
+        while (a < 0x1000 && (g->map[a] & CFG_DATA))
+            a++;
+        fprintf(f, "data %03x %03x\n", start, a);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/* Read an analysis from "f".
+ * Return 0 on success, -1 if it is not an analysis of this version or if
+ * there is no memory for its blocks. */
+int cfg_load(cfg_t *g, FILE *f) {
+    memset(g, 0, sizeof(*g));
+    char line[256];
+    int version = 0;
+    if (!fgets(line, sizeof(line), f) ||
+            sscanf(line, "chip8-cfg %d", &version) != 1 ||
+            version != CFG_VERSION)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long h;
+        unsigned start, end, succ[2];
+        char kind[16];
+        int n, k;
+        if (sscanf(line, "image %llx", &h) == 1) {
+            g->image = h;
+        } else if ((n = sscanf(line, "block %x %x %15s %x %x", &start, &end,
+                        kind, &succ[0], &succ[1])) >= 3) {
+            if (start >= end || end > 0x1000 || (end - start) % 2)
+                goto invalid;
+            cfg_block_t b = { .start = start, .end = end, .nsucc = n - 3 };
+            for (k = 0; k < NBLOCK_KINDS; k++)
+                if (strcmp(kind, cfg_kinds[k]) == 0)
+                    break;
+            if (k == NBLOCK_KINDS)
+                goto invalid;
+            b.kind = k;
+            for (k = 0; k < b.nsucc; k++)
+                b.succ[k] = succ[k] & 0xFFF;
+            if (add_block(g, &b) < 0)
+                goto invalid;
+
+            uint32_t a;
+            g->map[start] |= CFG_LEADER;
+            for (a = start; a < end; a += 2) {
+                g->map[a] |= CFG_INSTR | CFG_CODE;
+                g->map[a + 1] |= CFG_CODE;
+            }
+        } else if (sscanf(line, "data %x %x", &start, &end) == 2) {
+            if (start >= end || end > 0x1000)
+                goto invalid;
+            while (start < end)
+                g->map[start++] |= CFG_DATA;
+        }
+    }
+    return 0;
+
+invalid:
+    cfg_free(g);
+    return -1;
+}
+
+/* Decode every instruction of the analysis into the decode cache of "c",
+ * and with the JIT engine translate every block, before the program runs.
+ * "c" must have just been loaded with the analyzed image; return -1 (and
+ * leave "c" alone) if it holds another one. */
+int cfg_apply(cfg_t *g, chip8_t *c) {
+    if (image_hash(c) != g->image)
+        return -1;
+    int a, i;
+    for (a = 0; a <= 0xFFE; a += 2)
+        if (g->map[a] & CFG_INSTR)
+            cpu_predecode(c, a);
+    if (c->engine == ENGINE_JIT)
+        for (i = 0; i < g->nblocks; i++)
+            jit_precompile(c, g->blocks[i].start);
+    return 0;
+}
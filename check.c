@@ -0,0 +1,401 @@
+/* CHIP-8 CHECKS
+ *
+ * Differential test of the execution engines: seeded random programs run
+ * on the call engine, with idle loops run turn by turn, as the reference,
+ * and on the threaded and JIT engines (idle loops skipped) and the
+ * lockstep engine next to it. Every frame runs in two slices of random
+ * length, the keys changing in between, as the frontend runs them (see
+ * cpu_run). After every frame, the state hash, the random number
+ * generator and the fault of every machine must match the reference.
+ *
+ * Programs are random instructions, biased towards what keeps a program
+ * going: jumps and calls stay within the program, and short loops waiting
+ * on a timer or a key are mixed in so that there are idle loops to skip.
+ * Every lane of a lockstep group runs the same program with a seed and
+ * keys of its own, pairs of lanes sharing their keys so that groups run
+ * both together and apart.
+ *
+ * The same seed always checks the same programs; a failure names the
+ * program, lane, frame and engine, to reproduce it with -s and -n.
+ * Exit status is 1 if anything differed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define SEED        0x5eed1234
+
+/* Machines per program, each on every engine. */
+#define LANES       8
+
+/* Instructions per program. */
+#define PROGRAM_LEN 96
+
+static int programs = 200;
+static int frames = 60;
+static uint32_t seed = SEED;
+
+static uint32_t rng;
+
+static uint32_t rand_next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Address of a random instruction of a program of "len" instructions. */
+static uint16_t rand_target(int len) {
+    return 0x200 + 2 * (rand_next() % len);
+}
+
+/* Fill "rom" with a random program; return its size in bytes. */
+static size_t build_program(uint8_t *rom) {
+    int len = 0;
+    while (len < PROGRAM_LEN) {
+        uint16_t here = 0x200 + 2 * len;
+        uint16_t ops[3];
+        int n = 1, x = rand_next() % 16, i;
+        uint32_t r = rand_next();
+        switch (r % 24) {
+            /* Wait for the delay timer: FX07, 3X00, jump back. */
+            case 0:
+                ops[0] = 0xF007 | x << 8;
+                ops[1] = 0x3000 | x << 8;
+                ops[2] = 0x1000 | here;
+                n = 3;
+                break;
+            /* Wait for a key: FX0A, or EX9E/EXA1 and jump back. */
+            case 1:
+                ops[0] = 0xF00A | x << 8;
+                break;
+            case 2:
+                ops[0] = (r & 0x100 ? 0xE09E : 0xE0A1) | x << 8;
+                ops[1] = 0x1000 | here;
+                n = 2;
+                break;
+            case 3: ops[0] = 0x1000 | rand_target(PROGRAM_LEN); break;
+            case 4: ops[0] = 0x2000 | rand_target(PROGRAM_LEN); break;
+            case 5: ops[0] = r & 0x100 ? 0x00EE : 0x00E0; break;
+            case 6: ops[0] = 0xB000 | (rand_target(PROGRAM_LEN) - 0x10); break;
+            /* I into the program now and then: self-modifying code. */
+            case 7:
+                ops[0] = 0xA000 | (r & 0x100 ? rand_target(PROGRAM_LEN) :
+                                   0x200 + (rand_next() % 0xE00));
+                break;
+            case 8: ops[0] = (r & 0x100 ? 0xF015 : 0xF018) | x << 8; break;
+            case 9: ops[0] = 0xF055 | x << 8; break;
+            case 10: ops[0] = 0xF065 | x << 8; break;
+            case 11: ops[0] = 0xF033 | x << 8; break;
+            case 12: ops[0] = 0xF01E | x << 8; break;
+            case 13: ops[0] = 0xF029 | x << 8; break;
+            case 14: ops[0] = 0xD000 | (r >> 8 & 0xFFF); break;
+            case 15: ops[0] = 0xC000 | (r >> 8 & 0xFFF); break;
+            case 16: ops[0] = 0x8000 | (r >> 8 & 0xFF0) | (r >> 20) % 9; break;
+            case 17: ops[0] = 0x8000 | (r >> 8 & 0xFF0) | 0xE; break;
+            default:
+                /* 3XNN to 7XNN, 9XY0: plenty of plain arithmetic. */
+                ops[0] = (0x3000 + (r >> 8) % 6 * 0x1000) | (r >> 12 & 0xFFF);
+                if (ops[0] >> 12 == 9)
+                    ops[0] &= 0xFFF0;
+                break;
+        }
+        for (i = 0; i < n && len < PROGRAM_LEN; i++, len++) {
+            rom[2 * len] = ops[i] >> 8;
+            rom[2 * len + 1] = ops[i] & 0xFF;
+        }
+    }
+    return 2 * len;
+}
+
+/* Keys pressed by lane "lane" during half frame "half", as a bitmask: a
+ * few at a time, changed every few half frames. */
+static uint16_t lane_keys(uint32_t program, int lane, int half) {
+    uint32_t r = (program * 131 + lane / 2) * 2654435761u + half / 3;
+    r ^= r >> 15;
+    r *= 2246822519u;
+    r ^= r >> 13;
+    return r & (r >> 16) & (r >> 8);
+}
+
+static const char *engine_names[] = { "call", "threaded", "jit", "lockstep" };
+
+/* Check program number "p"; return 0 if every engine agreed. */
+static int check_program(uint32_t p) {
+    static chip8_t machines[3][LANES];
+    static uint8_t rom[0x1000 - 0x200];
+    rng = seed ^ (p * 2654435761u) ^ 0x9e3779b9;
+    if (rng == 0)
+        rng = 1;
+    size_t size = build_program(rom);
+    int cycles = 1 + rand_next() % 400;
+    int slice = rand_next() % (cycles + 1);
+
+    lockstep_t *g = lockstep_create(LANES);
+    if (g == NULL) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+    lockstep_load(g, rom, size);
+    int e, i, s, frame, k, failed = 0;
+    for (i = 0; i < LANES; i++) {
+        for (e = 0; e < 3; e++) {
+            chip8_t *c = &machines[e][i];
+            cpu_reset(c);
+            cpu_seed(c, p * LANES + i + 1);
+            cpu_load(c, rom, size);
+            c->engine = e;
+            c->idle_off = e == ENGINE_CALL;
+        }
+        lockstep_seed(g, i, p * LANES + i + 1);
+    }
+
+    for (frame = 0; frame < frames && !failed; frame++) {
+        for (i = 0; i < LANES; i++)
+            for (e = 0; e < 3; e++)
+                cpu_tick_timers(&machines[e][i]);
+        lockstep_tick_timers(g);
+        /* Each frame in two slices, with the keys changing in between. */
+        for (s = 0; s < 2; s++) {
+            int n = s == 0 ? slice : cycles - slice;
+            for (i = 0; i < LANES; i++) {
+                uint16_t mask = lane_keys(p, i, 2 * frame + s);
+                for (e = 0; e < 3; e++) {
+                    chip8_t *c = &machines[e][i];
+                    for (k = 0; k < 16; k++)
+                        c->keys[k] = (mask >> k) & 1;
+                    cpu_run(c, n);
+                }
+                lockstep_keys(g, i, mask);
+            }
+            lockstep_update(g, n);
+        }
+        for (i = 0; i < LANES; i++)
+            for (e = 0; e < 3; e++)
+                cpu_frame(&machines[e][i]);
+
+        for (i = 0; i < LANES && !failed; i++) {
+            chip8_t *ref = &machines[ENGINE_CALL][i];
+            uint64_t hash = cpu_hash(ref);
+            for (e = 1; e < 4; e++) {
+                chip8_t *c = e < 3 ? &machines[e][i] : lockstep_machine(g, i);
+                if (cpu_hash(c) != hash || c->rng != ref->rng ||
+                        c->fault != ref->fault) {
+                    printf("program %u lane %d frame %d: %s differs "
+                           "(PC %03x, call engine at %03x)\n", p, i, frame,
+                           engine_names[e], c->reg_PC, ref->reg_PC);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (e = 0; e < 3; e++)
+        for (i = 0; i < LANES; i++)
+            cpu_release(&machines[e][i]);
+    lockstep_free(g);
+    return failed;
+}
+
+/* Programs for the checks below, as opcodes. */
+static const uint16_t smc_program[] = {
+    0x606A, 0x6102,     /* V0 = 6A, V1 = 02 */
+    0xA20E, 0xF155,     /* overwrite 20E with 6A02 */
+    0x627B, 0xA210,     /* V2 = 123 */
+    0xF233,             /* overwrite 210 with 0102 (invalid) */
+    0x6A01,             /* 20E: VA = 1, until overwritten */
+    0x6C05,             /* 210: VC = 5, until overwritten */
+    0x1212,
+};
+
+static const uint16_t other_program[] = {
+    0x6B07, 0x7B01, 0x3B10, 0x1202, 0x1208,
+};
+
+static const uint16_t key_program[] = {
+    0x6507, 0xF50A,     /* V5 = 7, then wait for a key into V5 */
+    0x6601, 0x1206,     /* V6 = 1 once one came */
+};
+
+/* Write "n" opcodes "ops" to "rom"; return the size of the image. */
+static size_t assemble(uint8_t *rom, const uint16_t *ops, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        rom[2 * i] = ops[i] >> 8;
+        rom[2 * i + 1] = ops[i] & 0xFF;
+    }
+    return 2 * n;
+}
+
+/* Load "n" opcodes "ops" on "c", freshly reset with the check's seed. */
+static void load_ops(chip8_t *c, const uint16_t *ops, int n) {
+    uint8_t rom[64];
+    size_t size = assemble(rom, ops, n);
+    cpu_reset(c);
+    cpu_seed(c, seed);
+    cpu_load(c, rom, size);
+}
+
+/* Run "c" for a few frames and compare it with "ref", run the same way;
+ * print what differed, about "what", and return 1 if anything did. */
+static int compare_run(chip8_t *c, chip8_t *ref, const char *what) {
+    int frame;
+    for (frame = 0; frame < 4; frame++) {
+        cpu_update(c, 20);
+        cpu_update(ref, 20);
+    }
+    if (cpu_hash(c) == cpu_hash(ref) && c->fault == ref->fault)
+        return 0;
+    printf("%s on the %s engine: PC %03x, VA %02x, fault %d "
+           "(expected %03x, %02x, %d)\n", what, engine_names[c->engine],
+           c->reg_PC, c->reg[0xA], c->fault, ref->reg_PC, ref->reg[0xA],
+           ref->fault);
+    return 1;
+}
+
+/* Code decoded ahead of time by cfg_apply must be dropped like any other
+ * when it is overwritten, or when another image is loaded. */
+static int check_cfg_apply() {
+    static chip8_t c, ref;
+    static cfg_t g;
+    int e, failed = 0;
+    for (e = 0; e < 3; e++) {
+        load_ops(&c, smc_program, sizeof(smc_program) / 2);
+        c.engine = e;
+        if (cfg_build(&g, &c) < 0) {
+            fprintf(stderr, "chip8: out of memory\n");
+            exit(1);
+        }
+        cfg_apply(&g, &c);
+        load_ops(&ref, smc_program, sizeof(smc_program) / 2);
+        failed += compare_run(&c, &ref, "cfg_apply, then self-modifying code");
+
+        load_ops(&c, smc_program, sizeof(smc_program) / 2);
+        cfg_apply(&g, &c);
+        load_ops(&c, other_program, sizeof(other_program) / 2);
+        load_ops(&ref, other_program, sizeof(other_program) / 2);
+        failed += compare_run(&c, &ref, "cfg_apply, then another image");
+        cfg_free(&g);
+        cpu_release(&c);
+    }
+    return failed;
+}
+
+/* Whether "c" went past FX0A with key 0 if "pressed", or is still waiting
+ * if not; print what went wrong otherwise. */
+static int check_waiting(chip8_t *c, int pressed, const char *engine) {
+    int waiting = c->reg_PC == 0x202 && c->reg[5] == 7;
+    int taken = c->reg_PC == 0x206 && c->reg[5] == 0 && c->reg[6] == 1;
+    if (pressed ? taken : waiting)
+        return 0;
+    printf("FX0A with key 0 %s on the %s engine: PC %03x, V5 %02x\n",
+           pressed ? "pressed" : "released", engine, c->reg_PC, c->reg[5]);
+    return 1;
+}
+
+/* FX0A takes key 0 like any other key, on every engine. */
+static int check_key0() {
+    static chip8_t c;
+    uint8_t rom[64];
+    size_t size = assemble(rom, key_program, sizeof(key_program) / 2);
+    int e, i, pressed, failed = 0;
+    for (e = 0; e < 3; e++) {
+        load_ops(&c, key_program, sizeof(key_program) / 2);
+        c.engine = e;
+        for (pressed = 0; pressed < 2; pressed++) {
+            c.keys[0] = pressed;
+            cpu_update(&c, 10);
+            failed += check_waiting(&c, pressed, engine_names[e]);
+        }
+        cpu_release(&c);
+    }
+
+    lockstep_t *g = lockstep_create(LANES);
+    if (g == NULL) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+    lockstep_load(g, rom, size);
+    for (pressed = 0; pressed < 2; pressed++) {
+        for (i = 0; i < LANES; i++)
+            lockstep_keys(g, i, pressed);
+        lockstep_update(g, 10);
+        for (i = 0; i < LANES; i++)
+            failed += check_waiting(lockstep_machine(g, i), pressed, "lockstep");
+    }
+    lockstep_free(g);
+    return failed;
+}
+
+/* Every third byte changed is the worst case of the delta encoding of the
+ * rewind history: record such frames on the smallest ring it accepts and
+ * on a larger one, then step back over all of them. */
+static int check_rewind() {
+    static chip8_t c;
+    static uint8_t saved[4][STATE_SIZE], state[STATE_SIZE];
+    size_t sizes[2] = { 1024, 1 << 16 };
+    int i, k, frame, failed = 0;
+    for (k = 0; k < 2; k++) {
+        rewind_t *r;
+        while ((r = rewind_create(sizes[k])) == NULL)
+            sizes[k] += 256;
+        cpu_reset(&c);
+        cpu_seed(&c, seed);
+        for (frame = 0; frame < 4; frame++) {
+            if (frame > 0)
+                for (i = 0x200 + frame % 3; i < 0x1000; i += 3)
+                    c.memory[i] ^= 0xFF;
+            cpu_save(&c, saved[frame]);
+            rewind_push(r, &c);
+        }
+        frame = 3;
+        while (rewind_frames(r) > 0 && !failed) {
+            frame--;
+            if (rewind_step(r, &c) != 0)
+                failed = 1;
+            cpu_save(&c, state);
+            if (memcmp(state, saved[frame], STATE_SIZE) != 0)
+                failed = 1;
+        }
+        if (failed || frame == 3 || (k == 1 && frame != 0)) {
+            printf("rewind on a ring of %zu bytes: frame %d differs\n",
+                   sizes[k], frame);
+            failed = 1;
+        }
+        rewind_free(r);
+        cpu_release(&c);
+    }
+    return failed;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-check [-n programs] [-f frames] [-s seed]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:s:")) != -1) {
+        switch (opt) {
+            case 'n': programs = atoi(optarg); break;
+            case 'f': frames = atoi(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default: usage();
+        }
+    }
+    if (programs < 1 || frames < 1 || optind != argc)
+        usage();
+
+    int p, failed = 0;
+    for (p = 0; p < programs; p++)
+        failed += check_program(p);
+    printf("engines: %d of %d programs differ\n", failed, programs);
+    failed += check_cfg_apply();
+    failed += check_key0();
+    failed += check_rewind();
+    return failed > 0;
+}
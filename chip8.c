@@ -12,67 +12,67 @@
 
 #include "chip8.h"
 #include "instr.h"
-#include "digits.h"
 
+/* SDL window and renderer handlers */
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+/* WIDTHxHEIGHT streaming texture the framebuffer is converted into;
+ * the renderer scales it up to the window. */
+static SDL_Texture *texture;
 
-double time_getseconds() {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
-    return (double) ((double)t.tv_sec + (double)t.tv_nsec / 1e9);
-}
+static SDL_AudioSpec audio_desired, audio_obtained;
+static SDL_AudioDeviceID audio_devid;
 
-/* Reset CPU registers and load image file to memory */
-void cpu_reset(FILE *file) {
-    memset(reg, 0, sizeof(reg));    /* reset all data registers */
-    reg_I = 0;                      /* reset address register */
-    reg_PC = 0x200;                 /* programs start at 0x200 */
-    stack_init();                   /* reset stack */
-    memset(keys, 0, sizeof(keys));  /* reset input keys */
-    timer_delay = 0;                /* reset delay timer */
-    timer_sound = 0;                /* reset sound timer */
-
-    srand(time(NULL));               /* set random seed for rng */
-
-    /* All hexadecimal digits (0-9, A-F) have corresponding sprite 
-     * data already stored in the memory of the interpreter.
-     * We chose to store it beggining in address 0x000. */
-    memcpy(&memory[FONT], digits, sizeof(digits));
-
-    /* load image file to memory */
-    uint8_t *p = &memory[reg_PC];      
-    int max_read = 0xFFF - 0x200;    /* maximum file size */
-    fread(p, sizeof(uint8_t), max_read, file);
-}
+static int samples_per_second = 0;     // obtained sample rate to be filled after opening audio device
 
-void invalid_opcode(uint16_t opcode) {
-    fprintf(stderr, "chip8: invalid opcode %04x\n", opcode);
-    abort();
-}
+/* Beeper tone: one period of a sine wave, played back by a 32-bit phase
+ * accumulator whose top 8 bits index the table. */
+#define TONE_HZ         440
+#define WAVE_SIZE       256
+#define ENVELOPE_STEPS  128     // samples to fade the tone in or out
 
-SDL_AudioSpec audio_desired, audio_obtained;
-SDL_AudioDeviceID audio_devid;
+static int8_t   wavetable[WAVE_SIZE];
+static uint32_t phase;                 // position in the wave, a full turn is 2^32
+static uint32_t phase_step;            // phase advance per sample
+static int      envelope;              // current volume, 0 to ENVELOPE_STEPS
 
-int samples_per_second = 0;     // obtained sample rate to be filled after opening audio device
-int sample_nr = 0;              // used to keep track of the current sample
+/* Samples the tone has left to play; set by the emulation loop from
+ * timer_sound, counted down by the audio callback. Guarded by the audio
+ * device lock. */
+static int tone_samples;
 
+static void init_wavetable() {
+    int i;
+    for (i = 0; i < WAVE_SIZE; i++)
+        wavetable[i] = 127 * cos(2.0 * M_PI * i / WAVE_SIZE);
+    phase_step = (uint32_t)((double)TONE_HZ * 4294967296.0 / samples_per_second);
+}
 
 /* userdata: application-specific paremeter saved in userdata field
  * stream  : pointer to the audio data buffer
  * len     : lenfgt of that buffer in bytes
  */
-void mix_audio(void* userdata, uint8_t *stream, int len) {
+static void mix_audio(void* userdata, uint8_t *stream, int len) {
     int i;
-    for (i = 0; i < len; i++, sample_nr++) {
-        /* Calculate the time for the next sample. */ 
-        double t = (double)sample_nr / (double)samples_per_second; 
-        /* Calculate a single sample for time t. */
-        int8_t sample = 127 * cos(2.0 * M_PI * 440.0 * t);  // 440Hz sine wave
+    for (i = 0; i < len; i++) {
+        /* The tone is gated sample by sample: it stops exactly when the
+         * sound timer runs out, even in the middle of the buffer. Ramping
+         * the volume instead of cutting it avoids clicks. */
+        if (tone_samples > 0) {
+            tone_samples--;
+            if (envelope < ENVELOPE_STEPS)
+                envelope++;
+        } else if (envelope > 0) {
+            envelope--;
+        }
+        int8_t sample = wavetable[phase >> 24] * envelope / ENVELOPE_STEPS;
+        phase += phase_step;
         /* Fill the audio buffer with the calculated sample. */
         stream[i] = sample;
     }
 }
 
-void init_sdl() {
+static void init_sdl() {
     /* Initialize SDL with VIDEO and AUDIO subsystems. */
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "chip8: SDL_Init error: %s\n", SDL_GetError());
@@ -86,12 +86,18 @@ void init_sdl() {
 
     /* Initialize the renderer that will draw to the window. */
     renderer = SDL_CreateRenderer(window, -1, 0);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+    if (window == NULL || renderer == NULL || texture == NULL) {
+        fprintf(stderr, "chip8: SDL video error: %s\n", SDL_GetError());
+        exit(1);
+    }
 
     /* Configure audio parameters. */
     audio_desired.freq = 44100;         // samples per second 44,100 Hz
     audio_desired.format = AUDIO_S8;    // 8-bit bit depth (-128 to 127)
     audio_desired.channels = 1;         // mono
-    audio_desired.samples = 4096;       // size of the audio buffer in sample frames
+    audio_desired.samples = 1024;       // size of the audio buffer in sample frames
     audio_desired.callback = mix_audio;
     audio_desired.userdata = NULL;
 
@@ -101,235 +107,431 @@ void init_sdl() {
         exit(1);
     }
     samples_per_second = audio_obtained.freq;
+    init_wavetable();
+
+    /* The device plays all the time; mix_audio outputs silence while the
+     * sound timer is 0. */
+    SDL_PauseAudioDevice(audio_devid, 0);
 }
 
 
-/* Update the CPU state. 
- * It executes "cycles" number of instructions. 
- */
-void cpu_update(int cycles) {
-    while (cycles--) {     
-        /* Fetch opcode.
-         * CHIP-8 opcodes are 2-bytes, but it has a byte-addressable memory
-         * thus, we need to get two consecutive bytes to fech a single 
-         * opcode, hence the PC register is incremented twice. 
-         * Opcodes are big-endian; so the most significant bits are shifted
-         * left and OR'd with the least significant to obtain the full opcode. */
-        uint16_t opcode = (uint16_t)memory[reg_PC] << 8 | memory[reg_PC+1];  
-        reg_PC = reg_PC + 2;
-
-        /* The first hexadecimal digit of an opcode dictates which instruction 
-         * needs to be executed; in some cases, the last hex digit is also 
-         * needed. */
-        switch (opcode & 0xF000) {
-            /* 0NNN (not implemented), 00E0, 00EE */
-            case 0x0000:
-                switch (opcode & 0x000F) {
-                    case 0x0: op_00E0(opcode); break;
-                    case 0xE: op_00EE(opcode); break;
-                    default:
-                        invalid_opcode(opcode);
-                        break;
-                }
-                break;
-            /* 1NNN */
-            case 0x1000: op_1NNN(opcode); break;
-            /* 2NNN */
-            case 0x2000: op_2NNN(opcode); break;
-            /* 3XNN */
-            case 0x3000: op_3XNN(opcode); break;
-            /* 4XNN */
-            case 0x4000: op_4XNN(opcode); break;
-            /* 5XY0 */
-            case 0x5000: op_5XY0(opcode); break;
-            /* 6XNN */
-            case 0x6000: op_6XNN(opcode); break;
-            /* 7XNN */
-            case 0x7000: op_7XNN(opcode); break;
-            /* 8XYN - 8XY0, 8XY1, 8XY2, 8XY3, 8XY4, 8XY5, 8XY6, 8XY7, 8XYE */
-            case 0x8000: op_8XYN(opcode); break;
-            /* 9XY0 */
-            case 0x9000: op_9XY0(opcode); break;
-            /* ANNN */
-            case 0xA000: op_ANNN(opcode); break;
-            /* BNNN */
-            case 0xB000: op_BNNN(opcode); break;
-            /* CXNN */
-            case 0xC000: op_CXNN(opcode); break;
-            /* DXYN */
-            case 0xD000: op_DXYN(opcode); break;
-            /* EX9E, EXA1 */
-            case 0xE000:
-                switch (opcode & 0x000F) {
-                    case 0xE: op_EX9E(opcode); break;
-                    case 0x1: op_EXA1(opcode); break;
-                    default:
-                        invalid_opcode(opcode);
-                        break;
-                }
-                break;
-            /* FX07, FX0A, FX18, FX1E, FX29, FX33, FX15, FX55, FX65 */
-            case 0xF000:
-                switch (opcode & 0x000F) {
-                    case 0x0007: op_FX07(opcode); break;
-                    case 0x000A: op_FX0A(opcode); break;
-                    case 0x0008: op_FX18(opcode); break;
-                    case 0x000E: op_FX1E(opcode); break;
-                    case 0x0009: op_FX29(opcode); break;
-                    case 0x0003: op_FX33(opcode); break;
-                    case 0x0005:
-                        switch (opcode & 0x00F0) {
-                            case 0x0010: op_FX15(opcode); break;
-                            case 0x0050: op_FX55(opcode); break;
-                            case 0x0060: op_FX65(opcode); break;
-                            default:
-                                invalid_opcode(opcode);
-                                break;
-                       }
-                        break;
-                    default:
-                        invalid_opcode(opcode);
-                        break;
-                }
-                break;
-            default:
-                invalid_opcode(opcode);
-                break;
-        }
-    }
+/* Frames travel from the emulation thread to the main thread, which
+ * presents them, through a triple buffer: the emulation thread fills the
+ * back slot, then swaps it with the middle one; the main thread swaps the
+ * middle slot with the front one whenever it holds a newer frame, and
+ * draws the front one. Neither thread ever waits for the other: there is
+ * always a slot to write to, and the newest complete frame to show, the
+ * frames in between being dropped. */
+#define FRAME_FRESH     4       // middle slot holds a frame not taken yet
+
+static uint64_t frames[3][HEIGHT];
+static int frame_middle = 1;           // slot index | FRAME_FRESH, shared
+static int frame_back = 0;             // emulation thread only
+static int frame_front = 2;            // main thread only
+
+/* Emulation thread: hand "frame_buffer" over to the main thread. */
+static void frame_publish(const uint64_t *frame_buffer) {
+    memcpy(frames[frame_back], frame_buffer, sizeof(frames[0]));
+    frame_back = __atomic_exchange_n(&frame_middle, frame_back | FRAME_FRESH,
+            __ATOMIC_ACQ_REL) & 3;
 }
-    
-void render() {
-    /* Set the color to BLACK for clearing the screen */
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-
-    /* Now draw the pixels from frame_buffer to the screen;
-     * as the screen is resized by FACTOR, each pixel is drawn
-     * as a rectangle with size (w, h) = (FACTOR, FACTOR),
-     * filled with color WHITE. */
-    SDL_Rect pixel = { .w = FACTOR, .h = FACTOR }; 
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+
+/* Main thread: make the newest frame the front one, if there is one not
+ * taken yet. Return 1 if there was. */
+static int frame_take() {
+    if (!(__atomic_load_n(&frame_middle, __ATOMIC_ACQUIRE) & FRAME_FRESH))
+        return 0;
+    frame_front = __atomic_exchange_n(&frame_middle, frame_front,
+            __ATOMIC_ACQ_REL) & 3;
+    return 1;
+}
+
+static void render(const uint64_t *frame_buffer) {
+    /* Convert the whole framebuffer into the texture in one pass: each
+     * bit of a row becomes a WHITE or BLACK texel. */
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) < 0)
+        return;
     int x, y;
-    for (x = 0; x < WIDTH; x++) {
-        for (y = 0; y < WIDTH; y++) {
-            if (get_pixel(x, y) == 1) {
-                pixel.x = x * FACTOR;
-                pixel.y = y * FACTOR;
-                SDL_RenderFillRect(renderer, &pixel);
-            }
-        }
+    for (y = 0; y < HEIGHT; y++) {
+        uint32_t *texel = (uint32_t *)((uint8_t *)pixels + y * pitch);
+        uint64_t row = frame_buffer[y];
+        for (x = 0; x < WIDTH; x++, row <<= 1)
+            texel[x] = (row >> 63) ? 0xFFFFFFFF : 0xFF000000;
     }
-    /* Update the screen once all the pixels are rendered. */
+    SDL_UnlockTexture(texture);
+
+    /* Upload it once, scaled by FACTOR to the whole window, and update the
+     * screen. */
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 }
 
-void keys_update() {
-    /* Get a snapshot of the current state of the keyboard
-     * and update keys[16] with it. */
-    const uint8_t *keyboard_state = SDL_GetKeyboardState(NULL);
-
+/* Keyboard key of each CHIP-8 key. */
+static const SDL_Scancode keymap[16] = {
     /* 1 2 3 C                    1 2 3 4 */
-    keys[1]   = keyboard_state[SDL_SCANCODE_1];
-    keys[2]   = keyboard_state[SDL_SCANCODE_2];
-    keys[3]   = keyboard_state[SDL_SCANCODE_3];
-    keys[0xC] = keyboard_state[SDL_SCANCODE_4];
+    [1]   = SDL_SCANCODE_1,
+    [2]   = SDL_SCANCODE_2,
+    [3]   = SDL_SCANCODE_3,
+    [0xC] = SDL_SCANCODE_4,
     /* 4 5 6 D                    Q W E R */
-    keys[4]   = keyboard_state[SDL_SCANCODE_Q];
-    keys[5]   = keyboard_state[SDL_SCANCODE_W];
-    keys[6]   = keyboard_state[SDL_SCANCODE_E];
-    keys[0xD] = keyboard_state[SDL_SCANCODE_R];
+    [4]   = SDL_SCANCODE_Q,
+    [5]   = SDL_SCANCODE_W,
+    [6]   = SDL_SCANCODE_E,
+    [0xD] = SDL_SCANCODE_R,
     /* 7 8 9 E                    A S D F */
-    keys[7]   = keyboard_state[SDL_SCANCODE_A];
-    keys[8]   = keyboard_state[SDL_SCANCODE_S];
-    keys[9]   = keyboard_state[SDL_SCANCODE_D];
-    keys[0xE] = keyboard_state[SDL_SCANCODE_F];
+    [7]   = SDL_SCANCODE_A,
+    [8]   = SDL_SCANCODE_S,
+    [9]   = SDL_SCANCODE_D,
+    [0xE] = SDL_SCANCODE_F,
     /* A 0 B F                    Z X C V */
-    keys[0xA] = keyboard_state[SDL_SCANCODE_Z];
-    keys[0]   = keyboard_state[SDL_SCANCODE_X];
-    keys[0xB] = keyboard_state[SDL_SCANCODE_C];
-    keys[0xF] = keyboard_state[SDL_SCANCODE_V];
+    [0xA] = SDL_SCANCODE_Z,
+    [0]   = SDL_SCANCODE_X,
+    [0xB] = SDL_SCANCODE_C,
+    [0xF] = SDL_SCANCODE_V,
+};
+
+/* CHIP-8 key of a keyboard key, or -1 if it is none. */
+static int key_of(SDL_Scancode scancode) {
+    int k;
+    for (k = 0; k < 16; k++)
+        if (keymap[k] == scancode)
+            return k;
+    return -1;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: ./chip8 file nop6\n");
-        exit(1);
-    }
-
-    /* Number of opcodes to fetch and execute in each emulation loop. */
-    int cycles_per_frame = 0;
-    if (argc == 3)
-        cycles_per_frame = atoi(argv[2]);
+static void usage() {
+    fprintf(stderr, "usage: ./chip8 [-e engine] [-t] [-l] [-m movie] [-s stats] "
+            "[-g profile]\n"
+            "               file [cycles]\n");
+    exit(1);
+}
 
-    /* get image file from path in arguments and reset cpu */
-    FILE *file = fopen(argv[1], "r");
-    if (!file) {
-        fprintf(stderr, "chip8: error opening file (%s)\n", argv[1]);
-        exit(1);
+/* The machine driven by this frontend. */
+static chip8_t chip8;
+
+/* Rewind history: about four minutes of typical frames. */
+#define REWIND_SIZE (4 << 20)
+static rewind_t *history;
+
+/* Input movie being recorded, if any. */
+static movie_t movie;
+static char *movie_path;
+
+/* Where to write the execution counters at exit, if anywhere. */
+static char *stats_path;
+/* Where to write the guest call graph at exit, if anywhere. */
+static char *profile_path;
+
+/* Number of opcodes to fetch and execute in each emulated frame. */
+static int cycles_per_frame = 10;
+
+/* Key events, timestamped by the main thread as they come in, and the
+ * latency of the program seeing them; printed at exit with -l. */
+static input_queue_t input;
+static int latency_report;
+
+/* Instruction slices per frame: key events are applied before each. */
+#define INPUT_SLICES    8
+
+/* Input, from the main thread to the emulation thread, and whether to go
+ * on at all. Read and written atomically. */
+static int input_rewind;               // BACKSPACE held
+/* Turbo mode: emulate as many frames as possible instead of 60 per
+ * second. It can also be toggled with TAB while running. */
+static int input_turbo;
+static int running = 1;
+
+/* Run one frame of instructions in INPUT_SLICES slices, applying the key
+ * events that came in before each. Unless in turbo mode, the slices are
+ * spread over the frame's 1/60 seconds from "start": a key event waits
+ * for the next slice, not for the next frame. While a movie is being
+ * recorded, keys only change between frames, as the movie has them. */
+static void run_frame(chip8_t *c, double start, int turbo) {
+    int s, done = 0;
+    for (s = 0; s < INPUT_SLICES; s++) {
+        double now = time_getseconds();
+        double at = start + s / (60.0 * INPUT_SLICES);
+        if (!turbo && now < at) {
+            struct timespec rqtp = { .tv_sec = 0, .tv_nsec = (at - now) * 1e9 };
+            nanosleep(&rqtp, NULL);
+            stats_idle(c, time_getseconds() - now);
+            now = time_getseconds();
+        }
+        if (!movie_path)
+            input_apply(&input, c, now);
+        int n = cycles_per_frame * (s + 1) / INPUT_SLICES - done;
+        if (n > 0) {
+            cpu_run(c, n);
+            done += n;
+        }
+        input_observe(&input, c, time_getseconds());
     }
-    cpu_reset(file);
-    fclose(file);
+    cpu_frame(c);
+}
 
-    /* Initialize SDL Window and Renderer. */
-    init_sdl();
+/* Emulation thread: runs the machine, 60 frames per second (or as many as
+ * it can in turbo mode), and publishes every frame drawn to. */
+static int emulate(void *data) {
+    chip8_t *c = data;
+    int turbo = 0;
+    int fault_shown = 0;
+
+    /* Speed report, printed once per second in turbo mode. */
+    double report_start = time_getseconds();
+    long report_frames = 0;
 
-    /* begin emulation loop */
-    int running = 1;
-    while (running) { 
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
         /* Get the time at the beginning of the loop. It will be used later
          * to slow it down to 60Hz */
         double start = time_getseconds();
-    
-        /* Reset all input keys; if any of them is set, it will be handled
-         * by the event handler. */
-        memset(keys, 0, sizeof(keys));
-        /* Handle events on the event queue. It keeps processing the events on
-         * the event queue until its empty. */
-        SDL_Event e;
-        while (SDL_PollEvent(&e)) {
-            /* SDL_QUITs are generated for a variety of reasons.
-             * In MacOS it will be triggered by CMD+Q; in POSIX it will 
-             * handle SIGINT and SIGTERM if they are not handled elsewhere. */
-            if (e.type == SDL_QUIT) {
-                running = 0;
-            }
+
+        if (turbo != __atomic_load_n(&input_turbo, __ATOMIC_RELAXED)) {
+            turbo = !turbo;
+            report_start = time_getseconds();
+            report_frames = 0;
         }
 
-        /* Get keyboard state and update keys[16] array that is used by the 
-         * instructions to know about the keyboard input. */
-        keys_update();
+        /* Update keys[16] array that is used by the instructions to know
+         * about the keyboard input, with the key events so far. */
+        input_apply(&input, c, start);
+
+        /* While BACKSPACE is held, go back in time one recorded frame per
+         * loop instead of emulating. A movie must be a straight run from
+         * reset, so there is no going back while recording one. */
+        if (!movie_path && __atomic_load_n(&input_rewind, __ATOMIC_RELAXED)) {
+            /* The keys held are the ones now, not the recorded ones: only
+             * key events change them. */
+            uint8_t keys[16];
+            memcpy(keys, c->keys, sizeof(keys));
+            rewind_step(history, c);
+            memcpy(c->keys, keys, sizeof(keys));
+        } else {
+            /* Run one emulated frame per loop; in turbo mode, keep running
+             * frames until this loop's 1/60 seconds are over, so input, sound
+             * and the screen are still handled at 60Hz. */
+            do {
+                /* Out of memory for the movie: stop, keeping the frames
+                 * recorded so far. */
+                if (movie_path && movie_record(&movie, c) < 0) {
+                    fprintf(stderr, "chip8: out of memory, recording stopped\n");
+                    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+                    return 0;
+                }
 
-        /* Since we force the emulation loop to run at (approximately) 60Hz,
-         * we can use it to  update the timers (decrement if less than zero). */
-        if (timer_delay > 0) timer_delay--; 
-        if (timer_sound > 0) timer_sound--;
+                /* Timers tick once per emulated frame, that is, on emulated
+                 * time: in turbo mode they run just as fast as the program
+                 * (decrement if less than zero). */
+                cpu_tick_timers(c);
+
+                /* Update the CPU state by "cycles" instructions. This value is arbitrary
+                 * and must be fiddled with to achieve the right emulation speed.
+                 * The cycles value is the number of instructions that will execute
+                 * every 1/60 seconds (16 ms). */
+                run_frame(c, start, turbo);
+                report_frames++;
+            } while (turbo && time_getseconds() - start < 1.0/60);
+
+            /* Record the frame. In turbo mode only the last frame of each
+             * loop is recorded: saving a state per frame would cost more
+             * than running it. */
+            rewind_push(history, c);
+        }
 
-        /* Update the CPU state by "cycles" instructions. This value is arbitrary
-         * and must be fiddled with to achieve the right emulation speed.
-         * The cycles value is the number of instructions that will execute
-         * every 1/60 seconds (16 ms). */
-        cpu_update(cycles_per_frame);
+        /* A program that faults is stuck on the faulting instruction,
+         * until rewound past it: say where, once. */
+        if (c->fault && !fault_shown)
+            fprintf(stderr, "chip8: %s at %03x\n", fault_names[c->fault],
+                    c->fault_PC);
+        fault_shown = c->fault != FAULT_NONE;
+
+        if (turbo && time_getseconds() - report_start >= 1.0) {
+            double elapsed = time_getseconds() - report_start;
+            fprintf(stderr, "chip8: %.2f MIPS, %.0f frames/s\n",
+                    report_frames * cycles_per_frame / elapsed / 1e6,
+                    report_frames / elapsed);
+            report_start = time_getseconds();
+            report_frames = 0;
+        }
 
-        /* SDL_PauseAudioDevice(devid, 0) will start playing; non-zero will pause.
-         * So we can pass directly the negated timer_sound value: while it's higher
-         * than 0 will continue playing, and once it reaches 0 it will pause. */ 
-        SDL_PauseAudioDevice(audio_devid, !timer_sound);
+        /* The sound timer counts down at 60Hz: the tone lasts for as many
+         * samples as it takes the timer to reach 0. */
+        SDL_LockAudioDevice(audio_devid);
+        tone_samples = c->timer_sound * samples_per_second / 60;
+        SDL_UnlockAudioDevice(audio_devid);
 
-        /* Render the frame_buffer to screen. */
-        render();
+        /* Hand the frame_buffer over to be shown, if anything was drawn. */
+        if (c->dirty) {
+            frame_publish(c->frame_buffer);
+            c->dirty = 0;
+        }
 
         /* Force this loop to run at 60Hz (once every 16ms).
          * It does this by sleeping for the time remaining to complete 1/60 seconds
          * since the beginning of the loop; if it took more than 1/60s to run until
          * now: abort.
-         * Not a very accurate implementation, but shall do the trick for now. */
+         * Not a very accurate implementation, but shall do the trick for now.
+         * In turbo mode the frames above already took all of that time. */
+        if (turbo)
+            continue;
         struct timespec rqtp = {
             .tv_sec = 0,
             .tv_nsec = (start + 1.0/60 - time_getseconds()) * 1e9 
         };
+        double sleep_start = time_getseconds();
         nanosleep(&rqtp, NULL);
+        stats_idle(c, time_getseconds() - sleep_start);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    chip8_t *c = &chip8;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:tlm:s:g:")) != -1) {
+        switch (opt) {
+            case 'e':
+                /* execution engine: call, threaded or jit */
+                c->engine = cpu_engine(optarg);
+                if (c->engine < 0)
+                    usage();
+                break;
+            case 't':
+                input_turbo = 1;
+                break;
+            case 'l':
+                /* print the input latency at exit */
+                latency_report = 1;
+                break;
+            case 'm':
+                /* record the session to an input movie */
+                movie_path = optarg;
+                break;
+            case 's':
+            case 'g':
+                /* dump execution counters or the call graph at exit */
+                if (opt == 's')
+                    stats_path = optarg;
+                else
+                    profile_path = optarg;
+                if (stats_enable(c) < 0) {
+                    fprintf(stderr, "chip8: no execution counters (built without CHIP8_STATS, or out of memory)\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+    char *path = argv[optind];
+
+    if (optind + 1 < argc)
+        cycles_per_frame = atoi(argv[optind + 1]);
+
+    /* get image file from path in arguments and reset cpu */
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "chip8: error opening file (%s)\n", path);
+        exit(1);
+    }
+    cpu_reset(c);
+    if (cpu_load_file(c, file) < 0) {
+        fprintf(stderr, "chip8: image file too large (%s)\n", path);
+        exit(1);
+    }
+    fclose(file);
+    if (load_analysis(c, path) < 0)
+        fprintf(stderr, "chip8: ignoring stale analysis (%s.cfg)\n", path);
+    if (movie_path)
+        movie_begin(&movie, c, (uint32_t)time(NULL), cycles_per_frame);
+
+    /* Initialize SDL Window and Renderer. */
+    init_sdl();
+
+    history = rewind_create(REWIND_SIZE);
+    if (history == NULL) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+
+    /* Emulation runs on a thread of its own. This one handles events and
+     * presents the frames, so that a slow present (waiting for vsync, a
+     * busy compositor) takes nothing away from the program. */
+    SDL_Thread *thread = SDL_CreateThread(emulate, "emulation", c);
+    if (thread == NULL) {
+        fprintf(stderr, "chip8: SDL_CreateThread error: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    int redraw = 0;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        /* Handle events on the event queue, waiting a millisecond at most
+         * for one, so that new frames are not held up. */
+        SDL_Event e;
+        int pending = SDL_WaitEventTimeout(&e, 1);
+        while (pending) {
+            /* SDL_QUITs are generated for a variety of reasons.
+             * In MacOS it will be triggered by CMD+Q; in POSIX it will 
+             * handle SIGINT and SIGTERM if they are not handled elsewhere. */
+            if (e.type == SDL_QUIT) {
+                __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+            }
+            /* The window contents were lost: draw them again even if no
+             * new frame came. */
+            if (e.type == SDL_WINDOWEVENT &&
+                    e.window.event == SDL_WINDOWEVENT_EXPOSED) {
+                redraw = 1;
+            }
+            if (e.type == SDL_KEYDOWN && !e.key.repeat &&
+                    e.key.keysym.scancode == SDL_SCANCODE_TAB) {
+                __atomic_store_n(&input_turbo, !input_turbo, __ATOMIC_RELAXED);
+            }
+            /* Presses and releases go to the emulation thread as they
+             * come, with the time they came at. */
+            if ((e.type == SDL_KEYDOWN && !e.key.repeat) || e.type == SDL_KEYUP) {
+                int k = key_of(e.key.keysym.scancode);
+                if (k >= 0)
+                    input_push(&input, k, e.type == SDL_KEYDOWN,
+                            time_getseconds());
+            }
+            pending = SDL_PollEvent(&e);
+        }
+
+        __atomic_store_n(&input_rewind,
+                SDL_GetKeyboardState(NULL)[SDL_SCANCODE_BACKSPACE] != 0,
+                __ATOMIC_RELAXED);
+
+        /* Show the newest frame, if it is not on screen yet. */
+        if (frame_take() || redraw) {
+            render(frames[frame_front]);
+            redraw = 0;
+        }
+    }
+    SDL_WaitThread(thread, NULL);
+
+    if (movie_path) {
+        movie_end(&movie, c);
+        FILE *f = fopen(movie_path, "w");
+        if (!f || movie_save(&movie, f) < 0) {
+            fprintf(stderr, "chip8: error writing movie (%s)\n", movie_path);
+            exit(1);
+        }
+        fclose(f);
+    }
+    if (stats_path && write_stats(c, stats_path) < 0) {
+        fprintf(stderr, "chip8: error writing stats (%s)\n", stats_path);
+        exit(1);
+    }
+    if (profile_path && write_profile(c, profile_path) < 0) {
+        fprintf(stderr, "chip8: error writing profile (%s)\n", profile_path);
+        exit(1);
     }
+    if (latency_report)
+        input_report(&input, stderr);
 
     return 0;
 }
@@ -1,5 +1,9 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <SDL.h>
 
 /* screen dimensions */
 #define WIDTH   64
@@ -12,37 +16,352 @@
 /* base address for storing hex fonts */
 #define FONT    0x000
 
-/* 4K byte-addressable memory */
-uint8_t memory[0xFFF];
+/* idle loop detection: loops tracked at once, and how often to look */
+#define IDLE_SLOTS      4
+#define IDLE_INTERVAL   8       // jumps backwards between checks
+
+typedef struct chip8 chip8_t;
+typedef struct instr instr_t;
+
+/* Instruction handler */
+typedef void (*op_t)(chip8_t *c, const instr_t *in);
+
+/* A decoded instruction: the handler that executes it and its operands,
+ * already extracted from the opcode. */
+struct instr {
+    op_t     op;        /* op_decode if not decoded yet */
+    uint16_t nnn;
+    uint8_t  x, y;
+    uint8_t  nn, n;
+    uint8_t  id;        /* OP_* id of the handler, for the threaded engine */
+};
+
+/* Execution engines */
+enum {
+    ENGINE_CALL,        /* call the handler of every decoded instruction */
+    ENGINE_THREADED,    /* threaded code (computed goto) */
+    ENGINE_JIT,         /* x86-64 basic-block recompiler */
+    NENGINES
+};
+
+/* Faults: instructions the machine cannot run. A faulting instruction
+ * changes nothing but PC, which stays on it: from then on the machine
+ * is stuck there, the same way a program ends with a jump to itself. */
+enum {
+    FAULT_NONE,
+    FAULT_INVALID_OPCODE,
+    FAULT_STACK_OVERFLOW,       /* 2NNN with LEVELS calls pending */
+    FAULT_STACK_UNDERFLOW,      /* 00EE outside of any call */
+    FAULT_JUMP,                 /* 1NNN or 2NNN below 0x200 */
+    NFAULTS
+};
+
+/* State of the machine after a jump backwards, kept to detect idle loops:
+ * landing at the same place again in the same state means the program is
+ * going around in circles until the next frame (see cpu_idle). */
+typedef struct {
+    uint32_t frame;     /* window it was seen in (chip8_t.idle_frame) */
+    int      at;        /* instructions into the frame, negated */
+    uint16_t reg_PC;
+    uint16_t reg_I;
+    uint8_t  reg[16];
+    uint8_t  timer_delay, timer_sound;
+    uint16_t stack[LEVELS];
+    uint16_t sp;
+    uint32_t rng;
+    uint32_t writes;
+} idle_t;
+
+/* A single CHIP-8 machine.
+ * All the emulated state lives in this structure, so a process can host
+ * as many independent machines as it wants; every instruction and the
+ * cpu functions receive the machine they operate on. */
+struct chip8 {
+    /* 4K byte-addressable memory */
+    uint8_t memory[0x1000];
+
+    /* 16 8-bit data registers V0 to VF */
+    uint8_t reg[16];
+    /* 16-bit address register I */
+    uint16_t reg_I;
+    /* 16-bit program counter PC */
+    uint16_t reg_PC;
+
+    /* 8-bit timers */
+    uint8_t timer_delay;
+    uint8_t timer_sound;
+
+    /* 64x32 monochrome framebuffer, one bit per pixel: one 64-bit word
+     * per row, with the leftmost pixel in the most significant bit */
+    uint64_t frame_buffer[HEIGHT];
+    /* set whenever the framebuffer is drawn to (DXYN, 00E0); the frontend
+     * clears it once the frame is on screen */
+    uint8_t dirty;
+
+    /* input has 16 keys */
+    uint8_t keys[16];
+    /* keys the program looked at (EX9E, EXA1, FX0A taking one), bit k for
+     * key k; cleared by whoever measures input latency */
+    uint16_t keys_seen;
+
+    /* 12 levels call stack and stack pointer */
+    uint16_t stack[LEVELS];
+    uint16_t sp;
+
+    /* state of the random number generator used by CXNN;
+     * kept per machine instead of using the global rand() */
+    uint32_t rng;
+
+    /* first fault (FAULT_*) since the last reset, and where it happened */
+    uint8_t  fault;
+    uint16_t fault_PC;
+
+    /* bumped on every write to memory or to the screen */
+    uint32_t writes;
+    /* idle loop detection: the last states seen after jumps backwards,
+     * by target address, and jumps backwards left until the next check */
+    idle_t idle[IDLE_SLOTS];
+    int idle_countdown;
+    /* bumped every frame, and between the slices of one whenever the keys
+     * change: states seen in an older window are no good */
+    uint32_t idle_frame;
+    /* instructions of the frame up to the end of the current cpu_run, and
+     * the keys it ran with */
+    int idle_cycles;
+    uint8_t idle_keys[16];
+    /* set to run idle loops turn by turn rather than skip them */
+    uint8_t idle_off;
+
+    /* engine cpu_run runs the machine with (ENGINE_*) */
+    int engine;
+    /* recompiler state, created on first use by the JIT engine */
+    struct jit *jit;
+    /* execution counters, NULL unless enabled with stats_enable */
+    struct stats *stats;
+
+    /* Decode cache: the decoded instruction at every even address, so that
+     * the fetch/decode loop only decodes an opcode the first time it runs.
+     * Entries are invalidated whenever the memory behind them is written. */
+    instr_t dcache[0x1000 / 2];
+    /* 64-byte chunks of memory with no decoded entry in the cache, so that
+     * invalidating them (a reset, above all) costs nothing */
+    uint64_t dcache_clean;
+};
+
+void     stack_init(chip8_t *c);
+int      stack_push(chip8_t *c, uint16_t address);
+int      stack_pop(chip8_t *c, uint16_t *address);
+
+/* CPU */
+void     cpu_reset(chip8_t *c);
+int      cpu_load(chip8_t *c, const uint8_t *rom, size_t size);
+int      cpu_load_file(chip8_t *c, FILE *file);
+uint16_t cpu_fetch(chip8_t *c, uint16_t address);
+void     cpu_seed(chip8_t *c, uint32_t seed);
+int      cpu_halted(chip8_t *c);
+void     cpu_fault(chip8_t *c, int fault);
+void     cpu_decode(uint16_t opcode, instr_t *in);
+instr_t *cpu_predecode(chip8_t *c, uint16_t address);
+void     cpu_invalidate(chip8_t *c, uint16_t address, uint16_t size);
+void     cpu_update(chip8_t *c, int cycles);
+void     cpu_run(chip8_t *c, int cycles);
+void     cpu_frame(chip8_t *c);
+void     cpu_update_threaded(chip8_t *c, int cycles);
+void     cpu_update_jit(chip8_t *c, int cycles);
+int      cpu_idle(chip8_t *c, int cycles);
+int      cpu_engine(const char *name);
+void     cpu_tick_timers(chip8_t *c);
+uint64_t cpu_hash(chip8_t *c);
+uint64_t hash_bytes(const void *data, size_t size);
+
+extern const char *fault_names[NFAULTS];
+void     cpu_release(chip8_t *c);
+
+/* Save states */
+#define STATE_VERSION   1
+#define STATE_SIZE      4424
+
+size_t   cpu_save(chip8_t *c, uint8_t *buf);
+int      cpu_restore(chip8_t *c, const uint8_t *buf, size_t size);
+
+/* Input movies */
+typedef struct {
+    int      frame;
+    uint16_t mask;      /* keys pressed from "frame" on */
+} movie_event_t;
+
+typedef struct {
+    uint64_t image;     /* hash of the image the movie was recorded on */
+    uint32_t seed;
+    int      cycles;    /* cycles per frame */
+    int      frames;
+    uint64_t hash;      /* final state */
+    movie_event_t *events;
+    int      nevents;
+    int      capacity;
+} movie_t;
+
+void movie_begin(movie_t *m, chip8_t *c, uint32_t seed, int cycles);
+int  movie_record(movie_t *m, chip8_t *c);
+void movie_end(movie_t *m, chip8_t *c);
+void movie_free(movie_t *m);
+int  movie_save(movie_t *m, FILE *f);
+int  movie_load(movie_t *m, FILE *f);
+int  movie_play(movie_t *m, chip8_t *c);
+
+/* Rewind history */
+typedef struct rewind rewind_t;
+
+rewind_t *rewind_create(size_t size);
+void      rewind_free(rewind_t *r);
+void      rewind_clear(rewind_t *r);
+int       rewind_frames(rewind_t *r);
+void      rewind_push(rewind_t *r, chip8_t *c);
+int       rewind_step(rewind_t *r, chip8_t *c);
+
+/* ROM corpus archives */
+typedef struct corpus corpus_t;
+
+corpus_t      *corpus_open(const char *path);
+void           corpus_close(corpus_t *a);
+int            corpus_count(corpus_t *a);
+const uint8_t *corpus_image(corpus_t *a, int i, size_t *size, uint64_t *hash);
+const uint8_t *corpus_find(corpus_t *a, uint64_t hash, size_t *size);
+const uint8_t *corpus_lookup(corpus_t *a, const char *name, size_t *size);
+int            corpus_write(FILE *f, char **names, const uint8_t **data,
+                            const size_t *sizes, int n);
+
+/* Lockstep batches: many machines stepped together on the same image */
+typedef struct lockstep lockstep_t;
+
+lockstep_t *lockstep_create(int n);
+void        lockstep_free(lockstep_t *g);
+int         lockstep_load(lockstep_t *g, const uint8_t *rom, size_t size);
+void        lockstep_seed(lockstep_t *g, int i, uint32_t seed);
+void        lockstep_keys(lockstep_t *g, int i, uint16_t mask);
+void        lockstep_tick_timers(lockstep_t *g);
+void        lockstep_update(lockstep_t *g, int cycles);
+chip8_t    *lockstep_machine(lockstep_t *g, int i);
+
+/* Environments: machines stepped by a training loop, in a caller's buffer */
+typedef struct env env_t;
+
+/* Reward of the frame machine "c" of environment "i" just ran; setting
+ * "*done" ends the episode. */
+typedef float (*env_reward_t)(chip8_t *c, int i, uint8_t *done, void *user);
+
+size_t          env_size(int n);
+env_t          *env_create(void *buf, int n, const uint8_t *rom, size_t size,
+                           int cycles);
+void            env_release(env_t *e);
+void            env_hook(env_t *e, env_reward_t hook, void *user);
+void            env_reset(env_t *e, int i, uint32_t seed);
+void            env_step(env_t *e, const uint16_t *actions, int frames);
+chip8_t        *env_machine(env_t *e, int i);
+const uint64_t *env_observation(env_t *e, int i);
+const float    *env_rewards(env_t *e);
+const uint8_t  *env_done(env_t *e);
+
+/* Input events: timestamped key presses from another thread */
+#define INPUT_QUEUE     256
+#define INPUT_BUCKETS   200     // latency histogram, half a millisecond each
+
+typedef struct {
+    double   time;
+    uint8_t  key;
+    uint8_t  down;
+} input_event_t;
+
+typedef struct {
+    input_event_t events[INPUT_QUEUE];
+    unsigned head;              /* written by the producer only */
+    unsigned tail;              /* written by the consumer only */
+    /* latency measurement, by the consumer */
+    double   pressed[16];       /* time of a press not seen yet, or 0 */
+    long     observed, missed;
+    double   total_ms, max_ms;
+    long     histogram[INPUT_BUCKETS];
+} input_queue_t;
+
+void     input_init(input_queue_t *q);
+int      input_push(input_queue_t *q, int key, int down, double time);
+int      input_apply(input_queue_t *q, chip8_t *c, double until);
+void     input_observe(input_queue_t *q, chip8_t *c, double now);
+void     input_report(input_queue_t *q, FILE *f);
+
+/* Terminal rendering: incremental, with half blocks */
+typedef struct {
+    uint64_t shown[HEIGHT];     /* frame buffer as the terminal shows it */
+    int      valid;             /* 0 until the terminal is cleared */
+} term_t;
+
+void     term_init(term_t *t);
+size_t   term_draw(term_t *t, chip8_t *c, FILE *f);
+void     term_end(term_t *t, FILE *f);
+
+/* Static analysis: control-flow graph of an image */
+enum {
+    CFG_INSTR  = 1 << 0,    /* an instruction starts here */
+    CFG_CODE   = 1 << 1,    /* part of an instruction */
+    CFG_DATA   = 1 << 2,    /* read or written through I */
+    CFG_LEADER = 1 << 3,    /* a block starts here */
+};
 
-/* 16 8-bit data registers V0 to VF */
-uint8_t reg[16];
-/* 16-bit address register I */
-uint16_t reg_I;
-/* 16-bit program counter PC */
-uint16_t reg_PC;
+/* How a block ends */
+enum {
+    BLOCK_FALL,         /* runs into the next block */
+    BLOCK_JUMP,         /* 1NNN */
+    BLOCK_CALL,         /* 2NNN: the subroutine, then the return site */
+    BLOCK_RETURN,       /* 00EE */
+    BLOCK_SKIP,         /* skip not taken, then taken */
+    BLOCK_INDIRECT,     /* BNNN: successors unknown */
+    BLOCK_HALT,         /* 1NNN to itself */
+    BLOCK_STOP,         /* runs into an invalid opcode or out of memory */
+    NBLOCK_KINDS
+};
 
-/* 8-bit timers */
-uint8_t timer_delay;
-uint8_t timer_sound;
+typedef struct {
+    uint16_t start, end;    /* instructions in [start, end) */
+    uint16_t succ[2];
+    uint8_t  nsucc;
+    uint8_t  kind;          /* BLOCK_* */
+} cfg_block_t;
 
-/* 64x32 monochrome framebuffer */
-uint8_t frame_buffer[WIDTH*HEIGHT];
+typedef struct {
+    uint64_t image;             /* hash of the analyzed image */
+    uint8_t  map[0x1000];       /* CFG_* flags of every byte */
+    cfg_block_t *blocks;        /* sorted by start address */
+    int      nblocks;
+    int      capacity;
+} cfg_t;
 
-/* SDL window and renderer handlers */
-SDL_Window *window;
-SDL_Renderer *renderer;
+extern const char *cfg_kinds[NBLOCK_KINDS];
 
-/* input has 16 keys */
-uint8_t keys[16];
+int          cfg_build(cfg_t *g, chip8_t *c);
+void         cfg_free(cfg_t *g);
+cfg_block_t *cfg_find(cfg_t *g, uint16_t address);
+int          cfg_save(cfg_t *g, FILE *f);
+int          cfg_load(cfg_t *g, FILE *f);
+int          cfg_apply(cfg_t *g, chip8_t *c);
 
-/* 12 levels call stack and stack pointer */
-uint16_t stack[LEVELS];
-uint16_t sp;
+/* Execution counters */
+int      stats_enable(chip8_t *c);
+void     stats_free(chip8_t *c);
+void     stats_idle(chip8_t *c, double seconds);
+void     stats_dump(chip8_t *c, FILE *f, int json);
+void     stats_folded(chip8_t *c, FILE *f);
 
-void     stack_init();
-void     stack_push(uint16_t address);
-uint16_t stack_pop();
+/* Shared by the programs: a clock, and the files that go with an image */
+double   time_getseconds(void);
+int      load_analysis(chip8_t *c, const char *path);
+int      write_stats(chip8_t *c, const char *path);
+int      write_profile(chip8_t *c, const char *path);
 
-void invalid_opcode(uint16_t opcode);
+/* JIT */
+void     jit_reset(chip8_t *c);
+void     jit_free(chip8_t *c);
+void     jit_invalidate(chip8_t *c, uint16_t address, uint16_t size);
+void     jit_reload(chip8_t *c, uint64_t mask);
+void     jit_precompile(chip8_t *c, uint16_t address);
 
+#endif
@@ -0,0 +1,347 @@
+/* ROM corpus: many images packed in one archive, mapped read-only.
+ *
+ * An archive is mapped once and then shared by every machine loading from
+ * it: cpu_load copies an image straight from the mapping into the machine,
+ * so a batch over thousands of images does no file I/O past the first
+ * page faults, and all processes using the same archive share its pages
+ * through the page cache. The machine's memory is part of chip8_t (the
+ * engines address it at fixed offsets), so writes by the program only
+ * ever touch that copy; the mapping itself is never written.
+ *
+ * Images are stored once per content: names of identical files point to
+ * the same image, and images can be looked up by their hash (hash_bytes
+ * of the image) as well as by name.
+ *
+ * Archive layout (multi-byte fields little-endian):
+ *
+ *      "C8PK" version          4 + 4
+ *      images, names           4 + 4
+ *      image index             images * 16, sorted by hash:
+ *                                  hash 8, offset 4, size 4
+ *      name index              names * 8, sorted by name (strcmp):
+ *                                  name offset 4, image 4
+ *      names                   NUL-terminated
+ *      image data
+ *
+ * Offsets are from the start of the archive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CORPUS_VERSION  1
+#define HEADER_SIZE     16
+#define IMAGE_ENTRY     16
+#define NAME_ENTRY      8
+
+/* Largest image cpu_load accepts. */
+#define IMAGE_MAX       (0x1000 - 0x200)
+
+struct corpus {
+    const uint8_t *data;
+    size_t    size;
+    uint32_t  nimages;
+    uint32_t  nnames;
+    const uint8_t *images;      /* image index */
+    const uint8_t *names;       /* name index */
+    int       mapped;           /* data is mapped rather than allocated */
+};
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    put32(p, v);
+    put32(p + 4, v >> 32);
+}
+
+/* Map the whole file at "path"; NULL if it cannot be read. */
+static const uint8_t *map_file(const char *path, size_t *size, int *mapped) {
+#ifdef __unix__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED) {
+        *size = st.st_size;
+        *mapped = 1;
+        return p;
+    }
+#endif
+    /* No mmap: read it all instead. */
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = n > 0 ? malloc(n) : NULL;
+    if (buf && fread(buf, 1, n, f) != (size_t)n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *size = n;
+    *mapped = 0;
+    return buf;
+}
+
+static void unmap_file(const uint8_t *data, size_t size, int mapped) {
+#ifdef __unix__
+    if (mapped) {
+        munmap((void *)data, size);
+        return;
+    }
+#endif
+    free((void *)data);
+}
+
+/* Check every index entry once, so lookups can trust the archive. */
+static int validate(corpus_t *a) {
+    uint32_t i;
+    uint64_t last = 0;
+    for (i = 0; i < a->nimages; i++) {
+        const uint8_t *e = a->images + i * IMAGE_ENTRY;
+        uint64_t hash = get64(e);
+        uint32_t offset = get32(e + 8), size = get32(e + 12);
+        if ((i > 0 && hash <= last) || size > IMAGE_MAX ||
+                offset > a->size || size > a->size - offset)
+            return -1;
+        last = hash;
+    }
+    const char *prev = NULL;
+    for (i = 0; i < a->nnames; i++) {
+        const uint8_t *e = a->names + i * NAME_ENTRY;
+        uint32_t offset = get32(e);
+        if (offset >= a->size || get32(e + 4) >= a->nimages ||
+                !memchr(a->data + offset, '\0', a->size - offset))
+            return -1;
+        const char *name = (const char *)a->data + offset;
+        if (prev && strcmp(prev, name) >= 0)
+            return -1;
+        prev = name;
+    }
+    return 0;
+}
+
+/* Open the archive at "path".
+ * Return NULL if it cannot be read, is not an archive of this version or
+ * if there is no memory for it. */
+corpus_t *corpus_open(const char *path) {
+    size_t size;
+    int mapped;
+    const uint8_t *data = map_file(path, &size, &mapped);
+    if (!data)
+        return NULL;
+
+    corpus_t *a = calloc(1, sizeof(corpus_t));
+    if (a == NULL) {
+        unmap_file(data, size, mapped);
+        return NULL;
+    }
+    a->data = data;
+    a->size = size;
+    a->mapped = mapped;
+    if (size < HEADER_SIZE || memcmp(data, "C8PK", 4) != 0 ||
+            get32(data + 4) != CORPUS_VERSION)
+        goto invalid;
+    a->nimages = get32(data + 8);
+    a->nnames = get32(data + 12);
+    if ((size - HEADER_SIZE) / IMAGE_ENTRY < a->nimages ||
+            (size - HEADER_SIZE - a->nimages * IMAGE_ENTRY) / NAME_ENTRY < a->nnames)
+        goto invalid;
+    a->images = data + HEADER_SIZE;
+    a->names = a->images + a->nimages * IMAGE_ENTRY;
+    if (validate(a) < 0)
+        goto invalid;
+    return a;
+
+invalid:
+    corpus_close(a);
+    return NULL;
+}
+
+void corpus_close(corpus_t *a) {
+    if (a) {
+        unmap_file(a->data, a->size, a->mapped);
+        free(a);
+    }
+}
+
+/* Number of distinct images in the archive. */
+int corpus_count(corpus_t *a) {
+    return a->nimages;
+}
+
+/* The "i"-th image, in hash order: its bytes (read-only, valid until the
+ * archive is closed), with its size and hash. */
+const uint8_t *corpus_image(corpus_t *a, int i, size_t *size, uint64_t *hash) {
+    const uint8_t *e = a->images + i * IMAGE_ENTRY;
+    if (hash)
+        *hash = get64(e);
+    *size = get32(e + 12);
+    return a->data + get32(e + 8);
+}
+
+/* Find the image whose hash is "hash"; NULL if there is none. */
+const uint8_t *corpus_find(corpus_t *a, uint64_t hash, size_t *size) {
+    uint32_t lo = 0, hi = a->nimages;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint64_t h = get64(a->images + mid * IMAGE_ENTRY);
+        if (h == hash)
+            return corpus_image(a, mid, size, NULL);
+        if (h < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Find the image packed as "name"; NULL if there is none. */
+const uint8_t *corpus_lookup(corpus_t *a, const char *name, size_t *size) {
+    uint32_t lo = 0, hi = a->nnames;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = a->names + mid * NAME_ENTRY;
+        int cmp = strcmp((const char *)a->data + get32(e), name);
+        if (cmp == 0)
+            return corpus_image(a, get32(e + 4), size, NULL);
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Images and names being packed, sorted for their index. */
+typedef struct {
+    uint64_t hash;
+    const uint8_t *data;
+    size_t   size;
+    uint32_t offset;
+} pack_image_t;
+
+typedef struct {
+    const char *name;
+    uint32_t image;     /* index in sorted images */
+    uint64_t hash;
+} pack_name_t;
+
+static int by_hash(const void *x, const void *y) {
+    const pack_image_t *a = x, *b = y;
+    return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+static int by_name(const void *x, const void *y) {
+    return strcmp(((const pack_name_t *)x)->name, ((const pack_name_t *)y)->name);
+}
+
+/* Write an archive of "n" images to "f": "data[i]" holds the "sizes[i]"
+ * bytes of the image named "names[i]". Identical images are stored once.
+ * Return the number of distinct images, or -1 if an image is too large,
+ * a name is repeated, there is no memory or writing fails. */
+int corpus_write(FILE *f, char **names, const uint8_t **data,
+        const size_t *sizes, int n) {
+    pack_image_t *images = malloc((n + 1) * sizeof(pack_image_t));
+    pack_name_t *index = malloc((n + 1) * sizeof(pack_name_t));
+    int i, k, nimages = 0, result = -1;
+    if (images == NULL || index == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        if (sizes[i] > IMAGE_MAX)
+            goto done;
+        images[i].hash = hash_bytes(data[i], sizes[i]);
+        images[i].data = data[i];
+        images[i].size = sizes[i];
+        index[i].name = names[i];
+        index[i].hash = images[i].hash;
+    }
+
+    /* One image per hash; two different images with the same 64-bit hash
+     * cannot be told apart by corpus_find, so refuse them. */
+    qsort(images, n, sizeof(pack_image_t), by_hash);
+    for (i = 0; i < n; i++) {
+        if (nimages > 0 && images[i].hash == images[nimages - 1].hash) {
+            if (images[i].size != images[nimages - 1].size ||
+                    memcmp(images[i].data, images[nimages - 1].data,
+                        images[i].size) != 0)
+                goto done;
+            continue;
+        }
+        images[nimages++] = images[i];
+    }
+    qsort(index, n, sizeof(pack_name_t), by_name);
+    for (i = 0; i < n; i++) {
+        if (i > 0 && strcmp(index[i - 1].name, index[i].name) == 0)
+            goto done;
+        pack_image_t key = { .hash = index[i].hash };
+        pack_image_t *img = bsearch(&key, images, nimages,
+                sizeof(pack_image_t), by_hash);
+        index[i].image = img - images;
+    }
+
+    /* Lay out names, then image data. */
+    uint32_t offset = HEADER_SIZE + nimages * IMAGE_ENTRY + n * NAME_ENTRY;
+    uint32_t names_start = offset;
+    for (i = 0; i < n; i++)
+        offset += strlen(index[i].name) + 1;
+    for (i = 0; i < nimages; i++) {
+        images[i].offset = offset;
+        offset += images[i].size;
+    }
+
+    uint8_t buf[HEADER_SIZE];
+    memcpy(buf, "C8PK", 4);
+    put32(buf + 4, CORPUS_VERSION);
+    put32(buf + 8, nimages);
+    put32(buf + 12, n);
+    fwrite(buf, 1, HEADER_SIZE, f);
+    for (i = 0; i < nimages; i++) {
+        put64(buf, images[i].hash);
+        put32(buf + 8, images[i].offset);
+        put32(buf + 12, images[i].size);
+        fwrite(buf, 1, IMAGE_ENTRY, f);
+    }
+    uint32_t name = names_start;
+    for (i = 0; i < n; i++) {
+        put32(buf, name);
+        put32(buf + 4, index[i].image);
+        fwrite(buf, 1, NAME_ENTRY, f);
+        name += strlen(index[i].name) + 1;
+    }
+    for (i = 0; i < n; i++)
+        fwrite(index[i].name, 1, strlen(index[i].name) + 1, f);
+    for (k = 0; k < nimages; k++)
+        fwrite(images[k].data, 1, images[k].size, f);
+    result = ferror(f) ? -1 : nimages;
+
+done:
+    free(images);
+    free(index);
+    return result;
+}
@@ -0,0 +1,464 @@
+/* CHIP-8 core: reset, image loading, fetch/decode loop and timers.
+ *
+ * Nothing in here depends on SDL, so it can be linked into the frontend
+ * as well as into headless tools that never touch video or audio. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "instr.h"
+#include "digits.h"
+#include "stats.h"
+
+/* Reset CPU registers, memory and screen.
+ * The image must be loaded afterwards with cpu_load or cpu_load_file. */
+void cpu_reset(chip8_t *c) {
+    memset(c->memory, 0, sizeof(c->memory));        /* clear memory */
+    memset(c->frame_buffer, 0, sizeof(c->frame_buffer)); /* clear screen */
+    c->dirty = 1;
+    memset(c->reg, 0, sizeof(c->reg));      /* reset all data registers */
+    c->reg_I = 0;                           /* reset address register */
+    c->reg_PC = 0x200;                      /* programs start at 0x200 */
+    stack_init(c);                          /* reset stack */
+    memset(c->keys, 0, sizeof(c->keys));    /* reset input keys */
+    c->keys_seen = 0;
+    cpu_invalidate(c, 0, sizeof(c->memory));    /* drop decoded code */
+    jit_reset(c);                               /* and compiled code */
+    c->timer_delay = 0;                     /* reset delay timer */
+    c->timer_sound = 0;                     /* reset sound timer */
+    c->fault = FAULT_NONE;                  /* clear faults */
+
+    /* set random seed for rng; xorshift needs a non-zero state */
+    c->rng = (uint32_t)time(NULL) | 1;
+
+    /* All hexadecimal digits (0-9, A-F) have corresponding sprite 
+     * data already stored in the memory of the interpreter.
+     * We chose to store it beggining in address 0x000. */
+    memcpy(&c->memory[FONT], digits, sizeof(digits));
+}
+
+/* Copy an image of "size" bytes to memory, starting at 0x200.
+ * Return 0 on success or -1 if the image does not fit in memory. */
+int cpu_load(chip8_t *c, const uint8_t *rom, size_t size) {
+    if (size > sizeof(c->memory) - 0x200)   /* maximum file size */
+        return -1;
+    memcpy(&c->memory[0x200], rom, size);
+    cpu_invalidate(c, 0x200, size);
+    return 0;
+}
+
+/* Load image file to memory.
+ * Return 0 on success or -1 if the file is larger than the memory. */
+int cpu_load_file(chip8_t *c, FILE *file) {
+    uint8_t rom[sizeof(c->memory) - 0x200 + 1];
+    size_t size = fread(rom, sizeof(uint8_t), sizeof(rom), file);
+    return cpu_load(c, rom, size);
+}
+
+/* Fetch the opcode at "address".
+ * CHIP-8 opcodes are 2-bytes, but it has a byte-addressable memory
+ * thus, we need to get two consecutive bytes to fech a single opcode.
+ * Opcodes are big-endian; so the most significant bits are shifted
+ * left and OR'd with the least significant to obtain the full opcode. */
+uint16_t cpu_fetch(chip8_t *c, uint16_t address) {
+    /* PC can point anywhere (BNNN reaches 0x10FE): wrap like I does. */
+    return (uint16_t)c->memory[address & 0xFFF] << 8 |
+        c->memory[(address + 1) & 0xFFF];
+}
+
+/* Seed the random number generator used by CXNN, so that runs with the
+ * same seed and the same input are repeatable. */
+void cpu_seed(chip8_t *c, uint32_t seed) {
+    /* xorshift needs a non-zero state */
+    c->rng = seed ? seed : 0x2545f491;
+}
+
+/* Return 1 if the program reached a jump to itself (1NNN with NNN == PC),
+ * the usual way CHIP-8 programs end; nothing changes after that point but
+ * the timers. */
+int cpu_halted(chip8_t *c) {
+    return cpu_fetch(c, c->reg_PC) == (0x1000 | c->reg_PC);
+}
+
+const char *fault_names[NFAULTS] = {
+    [FAULT_NONE]            = "none",
+    [FAULT_INVALID_OPCODE]  = "invalid opcode",
+    [FAULT_STACK_OVERFLOW]  = "stack overflow",
+    [FAULT_STACK_UNDERFLOW] = "stack underflow",
+    [FAULT_JUMP]            = "jump below 0x200",
+};
+
+/* The instruction that just ran (PC is past it) cannot run: record the
+ * fault, unless an earlier one is pending, and leave PC on it. Handlers
+ * call this before changing anything else, so running the instruction
+ * again changes nothing and the machine stays stuck there. */
+void cpu_fault(chip8_t *c, int fault) {
+    c->reg_PC = c->reg_PC - 2;
+    if (c->fault == FAULT_NONE) {
+        c->fault = fault;
+        c->fault_PC = c->reg_PC;
+    }
+}
+
+/* Decrement the delay and sound timers.
+ * It must be called at 60Hz of emulated time (once every frame). */
+void cpu_tick_timers(chip8_t *c) {
+    if (c->timer_delay > 0) c->timer_delay--; 
+    if (c->timer_sound > 0) c->timer_sound--;
+}
+
+/* FNV-1a over a block of bytes, continuing from hash h. */
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Return a 64-bit hash of "size" bytes; used to identify images. */
+uint64_t hash_bytes(const void *data, size_t size) {
+    return fnv1a(0xcbf29ce484222325ULL, data, size);
+}
+
+/* Return a 64-bit hash of the whole machine state, random number
+ * generator included.
+ * Two machines with the same hash are (for all practical purposes) in the
+ * same state, which makes it handy to compare runs. */
+uint64_t cpu_hash(chip8_t *c) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = fnv1a(h, c->memory, sizeof(c->memory));
+    h = fnv1a(h, c->reg, sizeof(c->reg));
+    h = fnv1a(h, &c->reg_I, sizeof(c->reg_I));
+    h = fnv1a(h, &c->reg_PC, sizeof(c->reg_PC));
+    h = fnv1a(h, &c->timer_delay, sizeof(c->timer_delay));
+    h = fnv1a(h, &c->timer_sound, sizeof(c->timer_sound));
+    h = fnv1a(h, c->frame_buffer, sizeof(c->frame_buffer));
+    h = fnv1a(h, c->stack, sizeof(c->stack));
+    h = fnv1a(h, &c->sp, sizeof(c->sp));
+    h = fnv1a(h, &c->rng, sizeof(c->rng));
+    return h;
+}
+
+/* Handler of each instruction, indexed by instruction id. */
+op_t ops[NOPS] = {
+    [OP_INVALID] = op_invalid,
+    [OP_DECODE]  = op_decode,
+    [OP_00E0]    = op_00E0,
+    [OP_00EE]    = op_00EE,
+    [OP_1NNN]    = op_1NNN,
+    [OP_2NNN]    = op_2NNN,
+    [OP_3XNN]    = op_3XNN,
+    [OP_4XNN]    = op_4XNN,
+    [OP_5XY0]    = op_5XY0,
+    [OP_6XNN]    = op_6XNN,
+    [OP_7XNN]    = op_7XNN,
+    [OP_8XY0]    = op_8XY0,
+    [OP_8XY1]    = op_8XY1,
+    [OP_8XY2]    = op_8XY2,
+    [OP_8XY3]    = op_8XY3,
+    [OP_8XY4]    = op_8XY4,
+    [OP_8XY5]    = op_8XY5,
+    [OP_8XY6]    = op_8XY6,
+    [OP_8XY7]    = op_8XY7,
+    [OP_8XYE]    = op_8XYE,
+    [OP_9XY0]    = op_9XY0,
+    [OP_ANNN]    = op_ANNN,
+    [OP_BNNN]    = op_BNNN,
+    [OP_CXNN]    = op_CXNN,
+    [OP_DXYN]    = op_DXYN,
+    [OP_EX9E]    = op_EX9E,
+    [OP_EXA1]    = op_EXA1,
+    [OP_FX07]    = op_FX07,
+    [OP_FX0A]    = op_FX0A,
+    [OP_FX15]    = op_FX15,
+    [OP_FX18]    = op_FX18,
+    [OP_FX1E]    = op_FX1E,
+    [OP_FX29]    = op_FX29,
+    [OP_FX33]    = op_FX33,
+    [OP_FX55]    = op_FX55,
+    [OP_FX65]    = op_FX65,
+};
+
+/* Decode an opcode: resolve the handler that executes it and extract
+ * its operands. Opcodes that are not valid CHIP-8 instructions decode to
+ * op_invalid. */
+void cpu_decode(uint16_t opcode, instr_t *in) {
+    in->nnn = opcode & 0x0FFF;
+    in->x   = (opcode & 0x0F00) >> 8;
+    in->y   = (opcode & 0x00F0) >> 4;
+    in->nn  = opcode & 0x00FF;
+    in->n   = opcode & 0x000F;
+    in->id  = OP_INVALID;
+
+    /* The first hexadecimal digit of an opcode dictates which instruction 
+     * needs to be executed; in some cases, the last hex digit is also 
+     * needed. */
+    switch (opcode & 0xF000) {
+        /* 0NNN (not implemented), 00E0, 00EE */
+        case 0x0000:
+            switch (opcode & 0x000F) {
+                case 0x0: in->id = OP_00E0; break;
+                case 0xE: in->id = OP_00EE; break;
+            }
+            break;
+        /* 1NNN */
+        case 0x1000: in->id = OP_1NNN; break;
+        /* 2NNN */
+        case 0x2000: in->id = OP_2NNN; break;
+        /* 3XNN */
+        case 0x3000: in->id = OP_3XNN; break;
+        /* 4XNN */
+        case 0x4000: in->id = OP_4XNN; break;
+        /* 5XY0 */
+        case 0x5000: in->id = OP_5XY0; break;
+        /* 6XNN */
+        case 0x6000: in->id = OP_6XNN; break;
+        /* 7XNN */
+        case 0x7000: in->id = OP_7XNN; break;
+        /* 8XYN - 8XY0, 8XY1, 8XY2, 8XY3, 8XY4, 8XY5, 8XY6, 8XY7, 8XYE */
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0: in->id = OP_8XY0; break;
+                case 0x1: in->id = OP_8XY1; break;
+                case 0x2: in->id = OP_8XY2; break;
+                case 0x3: in->id = OP_8XY3; break;
+                case 0x4: in->id = OP_8XY4; break;
+                case 0x5: in->id = OP_8XY5; break;
+                case 0x6: in->id = OP_8XY6; break;
+                case 0x7: in->id = OP_8XY7; break;
+                case 0xE: in->id = OP_8XYE; break;
+            }
+            break;
+        /* 9XY0 */
+        case 0x9000: in->id = OP_9XY0; break;
+        /* ANNN */
+        case 0xA000: in->id = OP_ANNN; break;
+        /* BNNN */
+        case 0xB000: in->id = OP_BNNN; break;
+        /* CXNN */
+        case 0xC000: in->id = OP_CXNN; break;
+        /* DXYN */
+        case 0xD000: in->id = OP_DXYN; break;
+        /* EX9E, EXA1 */
+        case 0xE000:
+            switch (opcode & 0x000F) {
+                case 0xE: in->id = OP_EX9E; break;
+                case 0x1: in->id = OP_EXA1; break;
+            }
+            break;
+        /* FX07, FX0A, FX18, FX1E, FX29, FX33, FX15, FX55, FX65 */
+        case 0xF000:
+            switch (opcode & 0x000F) {
+                case 0x0007: in->id = OP_FX07; break;
+                case 0x000A: in->id = OP_FX0A; break;
+                case 0x0008: in->id = OP_FX18; break;
+                case 0x000E: in->id = OP_FX1E; break;
+                case 0x0009: in->id = OP_FX29; break;
+                case 0x0003: in->id = OP_FX33; break;
+                case 0x0005:
+                    switch (opcode & 0x00F0) {
+                        case 0x0010: in->id = OP_FX15; break;
+                        case 0x0050: in->id = OP_FX55; break;
+                        case 0x0060: in->id = OP_FX65; break;
+                    }
+                    break;
+            }
+            break;
+    }
+
+    in->op = ops[in->id];
+}
+
+/* Decode the instruction at even address "address" into its decode cache
+ * entry, ahead of its first execution or at it. Return the entry. */
+instr_t *cpu_predecode(chip8_t *c, uint16_t address) {
+    instr_t *entry = &c->dcache[address >> 1];
+    cpu_decode(cpu_fetch(c, address), entry);
+    /* Its chunk is no longer clean: cpu_invalidate has to look at it. */
+    c->dcache_clean &= ~(1ULL << (address >> 6));
+    return entry;
+}
+
+/* Handler of every cache entry that has not been decoded yet: decode the
+ * instruction in place and run it. Later executions go straight to the
+ * decoded handler, without checking the entry first. */
+void op_decode(chip8_t *c, const instr_t *in) {
+    instr_t *entry = cpu_predecode(c, (in - c->dcache) << 1);
+#ifdef CHIP8_STATS
+    /* Count the instruction as what it turned out to be. */
+    if (c->stats) {
+        c->stats->op[OP_DECODE]--;
+        c->stats->op[entry->id]++;
+    }
+#endif
+    entry->op(c, entry);
+}
+
+/* Drop the decoded instructions overlapping "size" bytes of memory
+ * starting at "address". It must be called after anything other than
+ * cpu_load writes to memory. */
+void cpu_invalidate(chip8_t *c, uint16_t address, uint16_t size) {
+    uint32_t end = (uint32_t)address + size;
+    if (end > sizeof(c->memory))
+        end = sizeof(c->memory);
+    c->writes++;
+    if (address < end) {
+        /* An instruction at an even address A spans bytes A and A+1, so a
+         * write to byte B only affects the cache entry B/2. Chunks of 32
+         * entries where nothing was decoded are skipped. */
+        uint32_t e, first = address >> 1, last = (end - 1) >> 1;
+        for (e = first; e <= last; e++) {
+            if (c->dcache_clean & (1ULL << (e >> 5)))
+                e |= 31;
+            else
+                c->dcache[e] = (instr_t){ .op = op_decode, .id = OP_DECODE };
+        }
+        /* Chunks cleared as a whole hold nothing decoded any more. */
+        uint32_t k, kfirst = (first + 31) >> 5, klast = (last + 1) >> 5;
+        for (k = kfirst; k < klast; k++)
+            c->dcache_clean |= 1ULL << k;
+    }
+    if (c->jit)
+        jit_invalidate(c, address, size);
+}
+
+/* Free everything the machine allocated on its own (the recompiler and
+ * the counters). The machine can still be used afterwards; it starts over
+ * from scratch. */
+void cpu_release(chip8_t *c) {
+    jit_free(c);
+    stats_free(c);
+}
+
+/* Engine names, as given on the command line. */
+const char *engines[NENGINES] = {
+    [ENGINE_CALL]     = "call",
+    [ENGINE_THREADED] = "threaded",
+    [ENGINE_JIT]      = "jit",
+};
+
+/* Return the ENGINE_* id of the engine called "name", or -1. */
+int cpu_engine(const char *name) {
+    int i;
+    for (i = 0; i < NENGINES; i++)
+        if (strcmp(engines[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/* Idle loop detection.
+ * Called now and then right after a jump backwards (or to itself, as FX0A
+ * does while no key is pressed), with "cycles" left in this cpu_run.
+ * Within a window (see chip8_t.idle_frame) the timers and the keys do not
+ * change, so if the machine
+ * lands at the same address again in exactly the same state, with nothing
+ * written to memory or to the screen since, it will keep going around the
+ * same loop until the window ends. Return how many of the cycles left can
+ * be skipped: whole turns of the loop, so the cpu_run ends in the very
+ * state it would have reached by running them.
+ * Nothing is skipped with idle_off set, nor while the execution counters
+ * are on: turns skipped would be missing from them. */
+int cpu_idle(chip8_t *c, int cycles) {
+    idle_t *s = &c->idle[(c->reg_PC >> 1) % IDLE_SLOTS];
+    /* Where in the frame this is, as a window can span several cpu_runs. */
+    int at = cycles - c->idle_cycles;
+    c->idle_countdown = IDLE_INTERVAL;
+    if (c->idle_off || c->stats)
+        return 0;
+    /* The JIT engine interprets single instructions with a cycle count of
+     * their own: a slot they recorded is only good for a later check if
+     * the machine went further into the frame since. */
+    if (s->frame == c->idle_frame && s->at > at &&
+            s->reg_PC == c->reg_PC &&
+            s->writes == c->writes && s->reg_I == c->reg_I &&
+            memcmp(s->reg, c->reg, sizeof(c->reg)) == 0 &&
+            s->timer_delay == c->timer_delay &&
+            s->timer_sound == c->timer_sound && s->rng == c->rng &&
+            s->sp == c->sp &&
+            memcmp(s->stack, c->stack, c->sp * sizeof(c->stack[0])) == 0) {
+        int period = s->at - at;
+        return cycles - cycles % period;
+    }
+
+    s->frame = c->idle_frame;
+    s->at = at;
+    s->reg_PC = c->reg_PC;
+    s->reg_I = c->reg_I;
+    memcpy(s->reg, c->reg, sizeof(c->reg));
+    s->timer_delay = c->timer_delay;
+    s->timer_sound = c->timer_sound;
+    s->sp = c->sp;
+    memcpy(s->stack, c->stack, sizeof(c->stack));
+    s->rng = c->rng;
+    s->writes = c->writes;
+    return 0;
+}
+
+/* Call engine: call the handler of every instruction. */
+static void cpu_update_call(chip8_t *c, int cycles) {
+    while (cycles--) {     
+        uint16_t pc = c->reg_PC;
+        instr_t *in, odd;
+
+        /* Instructions at even addresses are decoded once and then served
+         * from the decode cache; the rare ones at odd addresses (or past
+         * the end of memory) are decoded every time. */
+        if ((pc & 0xF001) == 0) {
+            in = &c->dcache[pc >> 1];
+        } else {
+            in = &odd;
+            cpu_decode(cpu_fetch(c, pc), in);
+        }
+
+        /* CHIP-8 opcodes are 2-bytes, hence the PC register is incremented
+         * twice before the instruction executes. */
+        STATS_INSTR(c, in->id, pc);
+        c->reg_PC = pc + 2;
+        in->op(c, in);
+
+        /* Jumped backwards: this may be an idle loop. */
+        if (c->reg_PC <= pc && --c->idle_countdown <= 0)
+            cycles -= cpu_idle(c, cycles);
+    }
+}
+
+/* Run "cycles" more instructions of the current frame, using the
+ * machine's execution engine (ENGINE_CALL, unless told otherwise). A
+ * frame can be run in several slices, changing the keys in between; it
+ * ends with cpu_frame.
+ */
+void cpu_run(chip8_t *c, int cycles) {
+    /* Loops are only idle while the keys stay the same. */
+    if (memcmp(c->keys, c->idle_keys, sizeof(c->keys)) != 0) {
+        memcpy(c->idle_keys, c->keys, sizeof(c->keys));
+        c->idle_frame++;
+    }
+    c->idle_cycles += cycles;
+    if (c->engine == ENGINE_THREADED)
+        cpu_update_threaded(c, cycles);
+    else if (c->engine == ENGINE_JIT)
+        cpu_update_jit(c, cycles);
+    else
+        cpu_update_call(c, cycles);
+}
+
+/* End the current frame and start the next one. */
+void cpu_frame(chip8_t *c) {
+    STATS_FRAME(c);
+    /* Loops are only idle within a frame: forget the last ones. */
+    c->idle_frame++;
+    c->idle_cycles = 0;
+}
+
+/* Update the CPU state. 
+ * It executes "cycles" number of instructions, a whole frame.
+ */
+void cpu_update(chip8_t *c, int cycles) {
+    cpu_run(c, cycles);
+    cpu_frame(c);
+}
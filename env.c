@@ -0,0 +1,141 @@
+/* Environments: many machines reset and stepped together by a training
+ * loop, Gym style.
+ *
+ * Everything lives in one buffer the caller provides (env_size bytes),
+ * laid out as
+ *
+ *      env_t                   header, padded to 64 bytes
+ *      chip8_t machines[n]
+ *      float   rewards[n]
+ *      uint8_t done[n]
+ *
+ * so observations, rewards and done flags are pointers into it: the frame
+ * buffer of environment i is the machine's own, which its instructions
+ * draw to, and rewards and done flags are written in place by env_step.
+ * Nothing is copied out of the machines and nothing is allocated once the
+ * environments are created (the JIT engine, if a machine is switched to
+ * it, allocates its code buffer on first use).
+ *
+ * A step holds the keys of an action for a number of frames; each frame
+ * ticks the timers and runs the machine, the way the frontend does, then
+ * asks the reward hook, if any, what the frame was worth. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+struct env {
+    int       n;
+    int       cycles;           /* cycles per frame */
+    env_reward_t reward;
+    void     *user;
+    size_t    size;             /* of the image */
+    uint8_t   image[0x1000 - 0x200];
+    chip8_t  *machines;
+    float    *rewards;
+    uint8_t  *done;
+};
+
+/* The header takes whole cache lines, so the machines start on one. */
+#define HEADER_SIZE     ((sizeof(env_t) + 63) & ~(size_t)63)
+
+/* Bytes of buffer "n" environments take. */
+size_t env_size(int n) {
+    return HEADER_SIZE + n * (sizeof(chip8_t) + sizeof(float) + 1);
+}
+
+/* Set up "n" environments running "size" bytes of "rom", "cycles"
+ * instructions per frame, in "buf" (env_size(n) bytes, aligned like
+ * malloc's). Every environment is reset with seed i + 1.
+ * Return NULL if the image does not fit in memory. */
+env_t *env_create(void *buf, int n, const uint8_t *rom, size_t size, int cycles) {
+    if (n < 1 || size > sizeof(((env_t *)0)->image))
+        return NULL;
+    memset(buf, 0, env_size(n));
+    env_t *e = buf;
+    e->n = n;
+    e->cycles = cycles;
+    e->size = size;
+    memcpy(e->image, rom, size);
+    e->machines = (chip8_t *)((uint8_t *)buf + HEADER_SIZE);
+    e->rewards = (float *)(e->machines + n);
+    e->done = (uint8_t *)(e->rewards + n);
+    int i;
+    for (i = 0; i < n; i++)
+        env_reset(e, i, i + 1);
+    return e;
+}
+
+/* Release what the machines hold; the buffer stays the caller's. */
+void env_release(env_t *e) {
+    int i;
+    for (i = 0; i < e->n; i++)
+        cpu_release(&e->machines[i]);
+}
+
+/* Call "hook" after every frame of every environment ("user" is passed
+ * along); NULL for no rewards. */
+void env_hook(env_t *e, env_reward_t hook, void *user) {
+    e->reward = hook;
+    e->user = user;
+}
+
+/* Start a new episode on environment "i", seeding its random numbers with
+ * "seed" so that episodes can be replayed. */
+void env_reset(env_t *e, int i, uint32_t seed) {
+    chip8_t *c = &e->machines[i];
+    cpu_reset(c);
+    cpu_seed(c, seed);
+    cpu_load(c, e->image, e->size);
+    e->rewards[i] = 0;
+    e->done[i] = 0;
+}
+
+/* Run every environment not done for "frames" frames, holding the keys of
+ * "actions[i]" (bit k is key k) on environment "i". Its reward becomes the
+ * sum of the rewards of those frames. An environment is done once it
+ * faults, halts or its hook says so, and then sits still, with no reward,
+ * until it is reset. */
+void env_step(env_t *e, const uint16_t *actions, int frames) {
+    int i, k, frame;
+    for (i = 0; i < e->n; i++) {
+        chip8_t *c = &e->machines[i];
+        float reward = 0;
+        uint8_t done = e->done[i];
+        for (k = 0; k < 16; k++)
+            c->keys[k] = (actions[i] >> k) & 1;
+        for (frame = 0; frame < frames && !done; frame++) {
+            cpu_tick_timers(c);
+            cpu_update(c, e->cycles);
+            if (e->reward)
+                reward += e->reward(c, i, &done, e->user);
+            if (c->fault || cpu_halted(c))
+                done = 1;
+        }
+        e->rewards[i] = reward;
+        e->done[i] = done;
+    }
+}
+
+/* Machine of environment "i", to read its memory or change its engine. */
+chip8_t *env_machine(env_t *e, int i) {
+    return &e->machines[i];
+}
+
+/* Screen of environment "i" (see chip8_t.frame_buffer): the observation,
+ * up to date after every step. Observations of consecutive environments
+ * are sizeof(chip8_t) bytes apart. */
+const uint64_t *env_observation(env_t *e, int i) {
+    return e->machines[i].frame_buffer;
+}
+
+/* Rewards and done flags of the last step, one per environment. */
+const float *env_rewards(env_t *e) {
+    return e->rewards;
+}
+
+const uint8_t *env_done(env_t *e) {
+    return e->done;
+}
@@ -0,0 +1,279 @@
+/* CHIP-8 FUZZING HARNESS
+ *
+ * LLVMFuzzerTestOneInput takes arbitrary bytes as an input script and an
+ * image, resets a machine and runs it for a bounded number of cycles.
+ * Faults (invalid opcodes, stack overflows...) are outcomes like any
+ * other, not crashes; only a bug in the core itself (a crash, a sanitizer
+ * report, a hang) stops the fuzzer.
+ *
+ * Input layout:
+ *
+ *      frames n            1
+ *      keys                n * 2: bitmask of the keys pressed during each
+ *                          of the first n frames (little-endian); the last
+ *                          one holds for the rest of the run
+ *      image               the rest, truncated to what fits in memory
+ *
+ * Coverage is in CHIP-8 terms: which addresses ran and which instructions
+ * they ran as, straight from the decode cache (an entry is decoded the
+ * first time its address runs), and which faults were hit. Instructions
+ * at odd addresses, and code overwritten during the run, are not counted;
+ * neither is code the JIT engine translated, which never goes through the
+ * decode cache, so the call engine (the default) is the one to fuzz with.
+ *
+ * Built with libFuzzer (make chip8-fuzz-libfuzzer, needs clang), those
+ * counters are handed to it as extra features next to its own. Built
+ * standalone (make chip8-fuzz), a small coverage-guided loop drives the
+ * same entry point, and files given on the command line are run once
+ * each, to reproduce an input. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "instr.h"
+
+#define SEED        0x5eed1234
+
+/* Coverage map: one counter per even address, instruction id and fault. */
+#define COVER_PC        0
+#define COVER_OP        (COVER_PC + 0x1000 / 2)
+#define COVER_FAULT     (COVER_OP + NOPS)
+#define COVER_SIZE      (COVER_FAULT + NFAULTS)
+
+#ifdef FUZZ_LIBFUZZER
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+static uint8_t coverage[COVER_SIZE];
+
+/* Length of a run: frames of "cycles" instructions. */
+static int frames = 8;
+static int cycles = 128;
+static int engine = ENGINE_CALL;
+
+static chip8_t machine;
+
+/* Run one input on "c" from a fresh reset. */
+static void run(chip8_t *c, const uint8_t *data, size_t size) {
+    size_t nkeys = 0;
+    if (size > 0) {
+        nkeys = data[0];
+        if (2 * nkeys > size - 1)
+            nkeys = (size - 1) / 2;
+        data++;
+        size--;
+    }
+    const uint8_t *keys = data;
+    const uint8_t *image = data + 2 * nkeys;
+    size_t image_size = size - 2 * nkeys;
+    if (image_size > sizeof(c->memory) - 0x200)
+        image_size = sizeof(c->memory) - 0x200;
+
+    cpu_reset(c);
+    cpu_seed(c, SEED);
+    cpu_load(c, image, image_size);
+
+    uint16_t mask = 0;
+    int frame, k;
+    for (frame = 0; frame < frames; frame++) {
+        if (frame < nkeys)
+            mask = keys[2 * frame] | keys[2 * frame + 1] << 8;
+        for (k = 0; k < 16; k++)
+            c->keys[k] = (mask >> k) & 1;
+        cpu_tick_timers(c);
+        cpu_update(c, cycles);
+        /* Nothing changes any more on a stuck machine. */
+        if (c->fault || cpu_halted(c))
+            break;
+    }
+}
+
+/* Set the coverage counters of what the last run on "c" did. */
+static void collect(chip8_t *c, uint8_t *map) {
+    int chunk, e;
+    for (chunk = 0; chunk < 64; chunk++) {
+        if (c->dcache_clean & (1ULL << chunk))
+            continue;
+        for (e = chunk * 32; e < (chunk + 1) * 32; e++) {
+            uint8_t id = c->dcache[e].id;
+            if (id != OP_DECODE) {
+                map[COVER_PC + e] = 1;
+                map[COVER_OP + id] = 1;
+            }
+        }
+    }
+    map[COVER_FAULT + c->fault] = 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    machine.engine = engine;
+    run(&machine, data, size);
+    collect(&machine, coverage);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+#define MAX_INPUT   1024
+#define MAX_CORPUS  4096
+
+typedef struct {
+    uint8_t data[MAX_INPUT];
+    size_t  size;
+} input_t;
+
+static input_t *corpus;
+static int      ncorpus;
+
+/* Everything covered so far, and how many runs ended in each fault. */
+static uint8_t  seen[COVER_SIZE];
+static long     faults[NFAULTS];
+
+static uint32_t rng = 0x12345678;
+
+static uint32_t rand_next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Mutate "in" in place: a few random bit flips, bytes and opcodes. */
+static void mutate(input_t *in) {
+    int i, n = 1 + rand_next() % 4;
+    for (i = 0; i < n; i++) {
+        uint32_t r = rand_next();
+        size_t at = (r >> 8) % MAX_INPUT;
+        if (at >= in->size)
+            in->size = at + 1;
+        switch (r & 3) {
+            case 0: in->data[at] ^= 1 << ((r >> 4) & 7); break;
+            case 1: in->data[at] = r >> 24; break;
+            case 2:
+                /* Two bytes at once: a whole opcode, if aligned. */
+                in->data[at] = r >> 24;
+                if (at + 1 < in->size)
+                    in->data[at + 1] = r >> 16;
+                break;
+            case 3:
+                /* Shorter image, or fewer script frames. */
+                if (in->size > 1)
+                    in->size = 1 + at % (in->size - 1);
+                break;
+        }
+    }
+}
+
+/* Fold the last run's coverage into "seen"; return 1 if it found
+ * something new. */
+static int merge_coverage() {
+    int i, found = 0;
+    for (i = 0; i < COVER_SIZE; i++) {
+        if (coverage[i] && !seen[i]) {
+            seen[i] = 1;
+            found = 1;
+        }
+    }
+    memset(coverage, 0, sizeof(coverage));
+    return found;
+}
+
+static void report(long runs, double elapsed) {
+    int i, pcs = 0, ops = 0;
+    for (i = 0; i < 0x1000 / 2; i++)
+        pcs += seen[COVER_PC + i];
+    for (i = 0; i < NOPS; i++)
+        ops += seen[COVER_OP + i];
+    printf("%ld runs in %.2fs: %.0f runs/s, corpus %d, %d addresses, "
+            "%d instruction kinds\n", runs, elapsed, runs / elapsed, ncorpus,
+            pcs, ops);
+    for (i = 1; i < NFAULTS; i++)
+        printf("    %-20s %ld\n", fault_names[i], faults[i]);
+}
+
+/* Run the file at "path" once and describe what it did. */
+static void replay(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "chip8: error opening file (%s)\n", path);
+        exit(1);
+    }
+    static uint8_t data[1 + 2 * 255 + 0x1000];
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    memset(coverage, 0, sizeof(coverage));
+    LLVMFuzzerTestOneInput(data, size);
+    chip8_t *c = &machine;
+    int i, pcs = 0;
+    for (i = 0; i < 0x1000 / 2; i++)
+        pcs += coverage[COVER_PC + i];
+    printf("%s: pc %03x, hash %016llx, %d addresses", path, c->reg_PC,
+            (unsigned long long)cpu_hash(c), pcs);
+    if (c->fault)
+        printf(", %s at %03x", fault_names[c->fault], c->fault_PC);
+    printf("\n");
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-fuzz [-e engine] [-f frames] [-c cycles] "
+            "[-n runs] [-s seed] [file...]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long runs = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:f:c:n:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                engine = cpu_engine(optarg);
+                if (engine < 0)
+                    usage();
+                break;
+            case 'f': frames = atoi(optarg); break;
+            case 'c': cycles = atoi(optarg); break;
+            case 'n': runs = atol(optarg); break;
+            case 's': rng = strtoul(optarg, NULL, 0) | 1; break;
+            default: usage();
+        }
+    }
+    if (frames < 1 || cycles < 1 || runs < 1)
+        usage();
+
+    if (optind < argc) {
+        int i;
+        for (i = optind; i < argc; i++)
+            replay(argv[i]);
+        return 0;
+    }
+
+    /* Start from a single empty input and keep whatever finds something
+     * new. */
+    corpus = calloc(MAX_CORPUS, sizeof(input_t));
+    if (corpus == NULL) {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+    ncorpus = 1;
+    input_t in;
+    long i;
+    double start = time_getseconds();
+    for (i = 0; i < runs; i++) {
+        in = corpus[rand_next() % ncorpus];
+        mutate(&in);
+        LLVMFuzzerTestOneInput(in.data, in.size);
+        faults[machine.fault]++;
+        if (merge_coverage() && ncorpus < MAX_CORPUS)
+            corpus[ncorpus++] = in;
+    }
+    report(runs, time_getseconds() - start);
+
+    cpu_release(&machine);
+    free(corpus);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,167 @@
+/* CHIP-8 HEADLESS RUNNER
+ *
+ * Runs an image for a fixed number of frames without initializing any
+ * video or audio, and prints the final state of the machine. It only
+ * links against the core library, so it runs on machines with no display.
+ * Random numbers are seeded with a fixed seed (-r to pick another), so
+ * two runs of the same image end in the same state.
+ *
+ * With -p, it replays an input movie instead, as fast as possible, and
+ * exits with status 0 only if the run ends in the recorded state.
+ *
+ * With -t, it draws the screen on the terminal as it runs, at 60 frames
+ * per second, sending only the cells that changed (see term.c): enough to
+ * watch a machine over a slow SSH link. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define SEED        0x5eed1234
+
+/* Write the execution counters and the call graph of "c", if asked for
+ * (NULL paths are not). */
+static void write_outputs(chip8_t *c, const char *stats_path,
+        const char *profile_path) {
+    if (stats_path && write_stats(c, stats_path) < 0) {
+        fprintf(stderr, "chip8: error writing stats (%s)\n", stats_path);
+        exit(1);
+    }
+    if (profile_path && write_profile(c, profile_path) < 0) {
+        fprintf(stderr, "chip8: error writing profile (%s)\n", profile_path);
+        exit(1);
+    }
+}
+
+/* Sleep until "deadline" (time_getseconds). */
+static void wait_until(double deadline) {
+    double left = deadline - time_getseconds();
+    if (left > 0) {
+        struct timespec t = { (time_t)left, (long)((left - (time_t)left) * 1e9) };
+        nanosleep(&t, NULL);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-headless [-e engine] [-c cycles] [-f frames] "
+            "[-r seed]\n"
+            "                      [-p movie] [-s stats] [-g profile] [-t] file\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    /* Number of opcodes to execute per frame and number of frames to run. */
+    int cycles_per_frame = 10;
+    int frames = 600;
+    int engine = ENGINE_CALL;
+    uint32_t seed = SEED;
+    char *movie_path = NULL;
+    char *stats_path = NULL;
+    char *profile_path = NULL;
+    int watch = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:c:f:r:p:s:g:t")) != -1) {
+        switch (opt) {
+            case 'e':
+                engine = cpu_engine(optarg);
+                if (engine < 0)
+                    usage();
+                break;
+            case 'c': cycles_per_frame = atoi(optarg); break;
+            case 'f': frames = atoi(optarg); break;
+            case 'r': seed = strtoul(optarg, NULL, 0); break;
+            case 'p': movie_path = optarg; break;
+            case 's': stats_path = optarg; break;
+            case 'g': profile_path = optarg; break;
+            case 't': watch = 1; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    /* get image file from path in arguments and reset cpu */
+    FILE *file = fopen(argv[optind], "r");
+    if (!file) {
+        fprintf(stderr, "chip8: error opening file (%s)\n", argv[optind]);
+        exit(1);
+    }
+    static chip8_t chip8;
+    chip8_t *c = &chip8;
+    cpu_reset(c);
+    cpu_seed(c, seed);
+    c->engine = engine;
+    if ((stats_path || profile_path) && stats_enable(c) < 0) {
+        fprintf(stderr, "chip8: no execution counters (built without CHIP8_STATS, or out of memory)\n");
+        exit(1);
+    }
+    if (cpu_load_file(c, file) < 0) {
+        fprintf(stderr, "chip8: image file too large (%s)\n", argv[optind]);
+        exit(1);
+    }
+    fclose(file);
+    if (load_analysis(c, argv[optind]) < 0)
+        fprintf(stderr, "chip8: ignoring stale analysis (%s.cfg)\n", argv[optind]);
+
+    if (movie_path) {
+        movie_t movie;
+        FILE *f = fopen(movie_path, "r");
+        if (!f) {
+            fprintf(stderr, "chip8: error opening movie (%s)\n", movie_path);
+            exit(1);
+        }
+        if (movie_load(&movie, f) < 0) {
+            fprintf(stderr, "chip8: invalid movie or out of memory (%s)\n",
+                    movie_path);
+            exit(1);
+        }
+        fclose(f);
+
+        int r = movie_play(&movie, c);
+        if (r < 0) {
+            fprintf(stderr, "chip8: movie was recorded on another image (%s)\n",
+                    movie_path);
+            exit(1);
+        }
+        printf("frames %d, instructions %ld, pc %03x, hash %016llx: %s\n",
+                movie.frames, (long)movie.frames * movie.cycles, c->reg_PC,
+                (unsigned long long)cpu_hash(c), r == 0 ? "ok" : "MISMATCH");
+        movie_free(&movie);
+        write_outputs(c, stats_path, profile_path);
+        return r;
+    }
+
+    /* Same loop as the frontend, minus input, rendering and pacing:
+     * tick the timers once per frame and run the frame's instructions. */
+    term_t term;
+    term_init(&term);
+    double start = time_getseconds();
+    int frame;
+    for (frame = 0; frame < frames; frame++) {
+        cpu_tick_timers(c);
+        cpu_update(c, cycles_per_frame);
+        if (watch) {
+            if (c->dirty) {
+                term_draw(&term, c, stdout);
+                c->dirty = 0;
+            }
+            wait_until(start + (frame + 1) / 60.0);
+        }
+    }
+    if (watch)
+        term_end(&term, stdout);
+
+    printf("frames %d, instructions %ld, pc %03x, hash %016llx",
+            frames, (long)frames * cycles_per_frame, c->reg_PC,
+            (unsigned long long)cpu_hash(c));
+    if (c->fault)
+        printf(", %s at %03x", fault_names[c->fault], c->fault_PC);
+    printf("\n");
+    write_outputs(c, stats_path, profile_path);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/* Input events: key presses and releases, timestamped by the thread that
+ * reads the keyboard and applied by the one running the machine, in
+ * between slices of a frame rather than once per frame. A tap shorter
+ * than a frame reaches the program, and a press reaches it within a
+ * slice.
+ *
+ * The queue is a ring with one producer and one consumer, neither of which
+ * ever waits: head is only written by the producer, tail by the consumer.
+ *
+ * Latency is measured from the time of a press to the end of the first
+ * slice in which the program looked at that key (EX9E, EXA1 or FX0A
+ * taking it; see chip8_t.keys_seen): what the player waits for, to the
+ * precision of a slice. A key released before the program ever looked at
+ * it counts as a missed press. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+
+/* Latency histogram buckets, in milliseconds: the last one takes
+ * everything above. */
+#define BUCKET_MS   0.5
+
+void input_init(input_queue_t *q) {
+    memset(q, 0, sizeof(input_queue_t));
+}
+
+/* Producer: queue a press ("down") or release of "key" at "time"
+ * (seconds, any clock the consumer uses as well).
+ * Return -1 if the queue is full and the event was dropped. */
+int input_push(input_queue_t *q, int key, int down, double time) {
+    unsigned head = q->head;
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == INPUT_QUEUE)
+        return -1;
+    input_event_t *e = &q->events[head % INPUT_QUEUE];
+    e->time = time;
+    e->key = key & 0xF;
+    e->down = down != 0;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Consumer: apply to the keys of "c" the events that happened up to
+ * "until", in order. Return the number of events applied. */
+int input_apply(input_queue_t *q, chip8_t *c, double until) {
+    unsigned tail = q->tail, head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; tail != head; tail++, n++) {
+        input_event_t *e = &q->events[tail % INPUT_QUEUE];
+        if (e->time > until)
+            break;
+        c->keys[e->key] = e->down;
+        if (e->down) {
+            if (q->pressed[e->key] == 0)
+                q->pressed[e->key] = e->time;
+        } else if (q->pressed[e->key] != 0) {
+            q->pressed[e->key] = 0;
+            q->missed++;
+        }
+    }
+    __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Consumer: after running "c", at "now", take the latency of the presses
+ * the program has looked at since the last call. */
+void input_observe(input_queue_t *q, chip8_t *c, double now) {
+    uint16_t seen = c->keys_seen;
+    c->keys_seen = 0;
+    int k;
+    for (k = 0; seen; k++, seen >>= 1) {
+        if (!(seen & 1) || q->pressed[k] == 0)
+            continue;
+        double ms = (now - q->pressed[k]) * 1e3;
+        q->pressed[k] = 0;
+        int b = ms < 0 ? 0 : ms / BUCKET_MS;
+        q->histogram[b < INPUT_BUCKETS ? b : INPUT_BUCKETS - 1]++;
+        q->observed++;
+        q->total_ms += ms;
+        if (ms > q->max_ms)
+            q->max_ms = ms;
+    }
+}
+
+/* Latency below which a fraction "p" of the observed presses are. */
+static double percentile(input_queue_t *q, double p) {
+    long want = (long)(p * q->observed), n = 0;
+    int b;
+    for (b = 0; b < INPUT_BUCKETS; b++) {
+        n += q->histogram[b];
+        if (n > want)
+            break;
+    }
+    return b < INPUT_BUCKETS - 1 ? (b + 1) * BUCKET_MS : q->max_ms;
+}
+
+/* Print the latency measured so far to "f". */
+void input_report(input_queue_t *q, FILE *f) {
+    fprintf(f, "chip8: input latency over %ld presses", q->observed);
+    if (q->observed)
+        fprintf(f, ": mean %.1f ms, p50 < %.1f ms, p99 < %.1f ms, max %.1f ms",
+                q->total_ms / q->observed, percentile(q, 0.5),
+                percentile(q, 0.99), q->max_ms);
+    fprintf(f, "; %ld released unseen\n", q->missed);
+}
@@ -8,95 +8,105 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <assert.h>
 
 #include "instr.h"
 #include "debug.c"
 
 /* 00E0     Clear the screen.
  */
-void op_00E0(uint16_t opcode) {
-    int screen_size = WIDTH * HEIGHT;
-    memset(frame_buffer, 0, screen_size);
+void op_00E0(chip8_t *c, const instr_t *in) {
+    memset(c->frame_buffer, 0, sizeof(c->frame_buffer));
+    c->dirty = 1;
+    c->writes++;
 }
 
 /* 00EE     Return from a subroutine.
  */
-void op_00EE(uint16_t opcode) {
-    reg_PC = stack_pop();
+void op_00EE(chip8_t *c, const instr_t *in) {
+    if (stack_pop(c, &c->reg_PC) < 0)
+        cpu_fault(c, FAULT_STACK_UNDERFLOW);
 }
 
 /* 1NNN     Jump to address NNN.
  */
-void op_1NNN(uint16_t opcode) {
-    uint16_t nnn = opcode & 0x0FFF;
-    assert(nnn >= 0x200 && nnn <= 0xFFF);
-    reg_PC = nnn;
+void op_1NNN(chip8_t *c, const instr_t *in) {
+    uint16_t nnn = in->nnn;
+    if (nnn < 0x200) {
+        cpu_fault(c, FAULT_JUMP);
+        return;
+    }
+    c->reg_PC = nnn;
 }
 
 /* 2NNN     Execute subroutine starting at NNN.
  */
-void op_2NNN(uint16_t opcode) {
-    uint16_t nnn = opcode & 0x0FFF;
-    assert(nnn >= 0x200 && nnn <= 0xFFF);
+void op_2NNN(chip8_t *c, const instr_t *in) {
+    uint16_t nnn = in->nnn;
+    if (nnn < 0x200) {
+        cpu_fault(c, FAULT_JUMP);
+        return;
+    }
     /* First, push incremented PC to stack so we can return from subroutine 
      * later; only then jump to subroutine. */
-    stack_push(reg_PC);
-    reg_PC = nnn;
+    if (stack_push(c, c->reg_PC) < 0) {
+        cpu_fault(c, FAULT_STACK_OVERFLOW);
+        return;
+    }
+    c->reg_PC = nnn;
 }
 
 /* 3XNN     Skip the following instruction if the value of register VX equals NN.
  */
-void op_3XNN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t nn = opcode & 0x00FF;
+void op_3XNN(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t nn = in->nn;
 
-    uint8_t vx = reg[x];
+    uint8_t vx = c->reg[x];
     if (vx == nn)   
-        reg_PC = reg_PC + 2;
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* 4XNN     Skip the following instruction if the value of register VX 
  *          is not equal to NN.
  */
-void op_4XNN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t nn = opcode & 0x00FF;
+void op_4XNN(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t nn = in->nn;
 
-    uint8_t vx = reg[x];
+    uint8_t vx = c->reg[x];
     if (vx != nn)   
-        reg_PC = reg_PC + 2;
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* 5XY0     Skip the following instruction if the value of register VX 
  *          is equal to the value of register VY.
  */
-void op_5XY0(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t y  = (opcode & 0x00F0) >> 4;
+void op_5XY0(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t y  = in->y;
 
-    uint8_t vx = reg[x];
-    uint8_t vy = reg[y];
+    uint8_t vx = c->reg[x];
+    uint8_t vy = c->reg[y];
     if (vx == vy)   
-        reg_PC = reg_PC + 2;
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* 6XNN     Store number NN in register VX.
  */
-void op_6XNN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t nn = opcode & 0x00FF;
+void op_6XNN(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t nn = in->nn;
 
-    reg[x] = nn;
+    c->reg[x] = nn;
 }
 
 /* 7XNN     Add the value NN to register VX.
  */
-void op_7XNN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t nn = opcode & 0x00FF;
+void op_7XNN(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t nn = in->nn;
 
-    reg[x] = reg[x] + nn;
+    c->reg[x] = c->reg[x] + nn;
 }
 
 /* 8XYN - 8XY0, 8XY1, 8XY2, 8XY3, 8XY4, 8XY5, 8XY6, 8XY7, 8XYE
@@ -125,132 +135,152 @@ void op_7XNN(uint16_t opcode) {
  * 8XYE     Store the value of register VY shifted left one bit in register VX
  *          Set register VF to the most significant bit prior to the shift
  */
-void op_8XYN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t y  = (opcode & 0x00F0) >> 4;
-
-    /* The 8XY4 opcode needs the previous value of register X to compute
-     * if a carry will occur; hence this declaration here, once it is not
-     * possible to declare inside a switch statement. */
-    uint8_t prevx;
-
-    switch (opcode & 0x000F) {
-        /* 8XY0 VX = VY */
-        case 0x0:
-            reg[x] = reg[y];
-            break;
-        /* 8XY1 VX = VX OR VY */
-        case 0x1:
-            reg[x] = reg[x] | reg[y];
-            break;
-        /* 8XY2 VX = VX AND VY */
-        case 0x2:
-            reg[x] = reg[x] & reg[y];
-            break;
-        /* 8XY3 VX = VX XOR VY */
-        case 0x3:
-            reg[x] = reg[x] ^ reg[y];
-            break;
-        /* 8XY4 VX = VX + VY (carry on VF) */
-        case 0x4:
-            prevx = reg[x];
-            reg[x] = reg[x] + reg[y];
-            /* If carry occurs, the current value of VX is smaller than its
-             * previous value; so we set the carry flag on register VF. */
-            reg[0xF] = (reg[x] < prevx) ? 0x1 : 0x0;
-            break;
-        /* 8XY5 VX = VX - VY (borrow on VF) */
-        case 0x5:
-            /* If the value of VY (subtrahend) is greater than the value of
-             * VX (minuend), a borrow will occur; so we set the borrow flag
-             * to 0 on register VF. */
-            reg[0xF] = (reg[y] > reg[x]) ? 0x0 : 0x1;
-            reg[x] = reg[x] - reg[y];
-            break;
-        /* 8XY6 VX = VY >> 1 (LSB on VF) */
-        case 0x6:
-            /* Note: in some implementations, it simply ignores the Y register
-             * and do all operations on the X register.
-             * This implementation is wrong according to the CHIP-8 specification
-             * but some games (and test roms) were coded this way. */
-            reg[0xF] = reg[x] & 0x1;
-            reg[x] = reg[x] >> 1;
-
-            //reg[0xF] = reg[y] & 0x1;    /* LSB */
-            //reg[x] = reg[y] >> 1;
-            break;
-        /* 8XY7 VX = VY - VX (borrow on VF) */
-        case 0x7:
-            /* Same as 8XY5, but inverted minuend<->subtrahend. */
-            reg[0xF] = (reg[x] > reg[y]) ? 0x0 : 0x1;
-            reg[x] = reg[y] - reg[x];
-            break;
-        /* 8XYE VX = VY << 1 (MSB on VF) */
-        case 0xE:
-            /* See "Note" above. */
-            reg[0xF] = reg[x] >> 7;
-            reg[x]   = reg[x] << 1;
-
-            //reg[0xF] = reg[y] >> 7;   /* MSB */
-            //reg[x]   = reg[y] << 1;
-            break;
-        default:
-            invalid_opcode(opcode);
-            break;
-    }
+/* Each 8XYN variant has its own handler, so that the last nibble is
+ * resolved once at decode time instead of on every execution. */
+
+/* 8XY0 VX = VY */
+void op_8XY0(chip8_t *c, const instr_t *in) {
+    c->reg[in->x] = c->reg[in->y];
+}
+
+/* 8XY1 VX = VX OR VY */
+void op_8XY1(chip8_t *c, const instr_t *in) {
+    c->reg[in->x] = c->reg[in->x] | c->reg[in->y];
+}
+
+/* 8XY2 VX = VX AND VY */
+void op_8XY2(chip8_t *c, const instr_t *in) {
+    c->reg[in->x] = c->reg[in->x] & c->reg[in->y];
+}
+
+/* 8XY3 VX = VX XOR VY */
+void op_8XY3(chip8_t *c, const instr_t *in) {
+    c->reg[in->x] = c->reg[in->x] ^ c->reg[in->y];
+}
+
+/* 8XY4 VX = VX + VY (carry on VF) */
+void op_8XY4(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t y  = in->y;
+
+    /* The previous value of register X is needed to compute if a carry
+     * will occur. */
+    uint8_t prevx = c->reg[x];
+    c->reg[x] = c->reg[x] + c->reg[y];
+    /* If carry occurs, the current value of VX is smaller than its
+     * previous value; so we set the carry flag on register VF. */
+    c->reg[0xF] = (c->reg[x] < prevx) ? 0x1 : 0x0;
+}
+
+/* 8XY5 VX = VX - VY (borrow on VF) */
+void op_8XY5(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t y  = in->y;
+
+    /* If the value of VY (subtrahend) is greater than the value of
+     * VX (minuend), a borrow will occur; so we set the borrow flag
+     * to 0 on register VF. */
+    c->reg[0xF] = (c->reg[y] > c->reg[x]) ? 0x0 : 0x1;
+    c->reg[x] = c->reg[x] - c->reg[y];
+}
+
+/* 8XY6 VX = VY >> 1 (LSB on VF) */
+void op_8XY6(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+
+    /* Note: in some implementations, it simply ignores the Y register
+     * and do all operations on the X register.
+     * This implementation is wrong according to the CHIP-8 specification
+     * but some games (and test roms) were coded this way. */
+    c->reg[0xF] = c->reg[x] & 0x1;
+    c->reg[x] = c->reg[x] >> 1;
+
+    //c->reg[0xF] = c->reg[y] & 0x1;    /* LSB */
+    //c->reg[x] = c->reg[y] >> 1;
+}
+
+/* 8XY7 VX = VY - VX (borrow on VF) */
+void op_8XY7(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t y  = in->y;
+
+    /* Same as 8XY5, but inverted minuend<->subtrahend. */
+    c->reg[0xF] = (c->reg[x] > c->reg[y]) ? 0x0 : 0x1;
+    c->reg[x] = c->reg[y] - c->reg[x];
+}
+
+/* 8XYE VX = VY << 1 (MSB on VF) */
+void op_8XYE(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+
+    /* See "Note" in 8XY6. */
+    c->reg[0xF] = c->reg[x] >> 7;
+    c->reg[x]   = c->reg[x] << 1;
+
+    //c->reg[0xF] = c->reg[y] >> 7;   /* MSB */
+    //c->reg[x]   = c->reg[y] << 1;
 }
 
 /* 9XY0     Skip the following instruction if the value of register 
  *          VX is not equal to the value of register VY.
  */
-void op_9XY0(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t y  = (opcode & 0x00F0) >> 4;
+void op_9XY0(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t y  = in->y;
 
-    uint8_t vx = reg[x];
-    uint8_t vy = reg[y];
+    uint8_t vx = c->reg[x];
+    uint8_t vy = c->reg[y];
     if (vx != vy)   
-        reg_PC = reg_PC + 2;
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* ANNN     Store memory address NNN in register I.
  */
-void op_ANNN(uint16_t opcode) {
-    uint16_t nnn = opcode & 0x0FFF;
-    reg_I = nnn;
+void op_ANNN(chip8_t *c, const instr_t *in) {
+    uint16_t nnn = in->nnn;
+    c->reg_I = nnn;
 }
 
 /* BNNN     Jump to address NNN + V0.
  */
-void op_BNNN(uint16_t opcode) {
-    uint16_t nnn = opcode & 0x0FFF;
-    reg_PC = nnn + reg[0];
+void op_BNNN(chip8_t *c, const instr_t *in) {
+    uint16_t nnn = in->nnn;
+    c->reg_PC = nnn + c->reg[0];
+}
+
+/* Helper function for instruction CXNN.
+ * Advance the machine's xorshift32 generator and return its next state;
+ * each machine carries its own generator, so instances never share it. */
+uint32_t rng_next(chip8_t *c) {
+    uint32_t r = c->rng;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    return c->rng = r;
 }
 
 /* CXNN     Set VX to a random number with a mask of NN.
  */
-void op_CXNN(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    uint8_t nn = opcode & 0x00FF;
+void op_CXNN(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    uint8_t nn = in->nn;
 
     /* It generated a random number between 00 and FF; it then logical
      * ANDs this value with a byte mask in order to reduce the size of
      * the set of random numbers capable of being returned from this func. */
-    reg[x] = (uint8_t)(rand() % 0xFF) & nn;
+    c->reg[x] = (uint8_t)(rng_next(c) >> 24) & nn;
 }
 
-/* Helper functions to draw on screen */
-
-/* XOR pixel at screen position (x,y) with pixel p;
- * return the XOR'd pixel.
- */
-uint8_t xor_pixel(uint8_t x, uint8_t y, uint8_t p) {
-    return frame_buffer[x + WIDTH * y] ^= p;
+/* Handler for every opcode that does not decode to an instruction. */
+void op_invalid(chip8_t *c, const instr_t *in) {
+    cpu_fault(c, FAULT_INVALID_OPCODE);
 }
 
+/* Helper function to read the screen */
+
 /* Return pixel at screen position (x,y). */
-uint8_t get_pixel(uint8_t x, uint8_t y) {
-    return frame_buffer[x + WIDTH * y];
+uint8_t get_pixel(chip8_t *c, uint8_t x, uint8_t y) {
+    return (c->frame_buffer[y] >> (WIDTH - 1 - x)) & 1;
 }
 
 /* DYXN     Draw a sprite at position VX, VY with N bytes of sprite 
@@ -258,79 +288,79 @@ uint8_t get_pixel(uint8_t x, uint8_t y) {
  *          Set VF to 01 if any set pixels are changed to unset, 
  *          and 00 otherwise.
  */
-void op_DXYN(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
-    uint8_t y = (opcode & 0x00F0) >> 4;
-    uint8_t n = opcode & 0x000F;
+void op_DXYN(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
+    uint8_t y = in->y;
+    uint8_t n = in->n;
 
-    /* (x, y) positions to draw the sprite. */
-    uint8_t vx = reg[x];
-    uint8_t vy = reg[y];
-    /* original x position */
-    uint8_t ox = vx;
+    /* (x, y) positions to draw the sprite. The starting position wraps
+     * around the screen; the sprite itself is clipped at the right and
+     * bottom edges. */
+    uint8_t vx = c->reg[x] % WIDTH;
+    uint8_t vy = c->reg[y] % HEIGHT;
 
     /* Reset register VF before drawing the sprite. If any set pixel
      * is unset, VF will become 1; it will stay 0 otherwise. */
-    reg[0xF] = 0x00;
+    c->reg[0xF] = 0x00;
+    c->dirty = 1;
+    c->writes++;
 
     /* The sprite pixels are XOR'd with those of the screen. */
     int i;
-    for (i = 0; i < n; i++) {
+    for (i = 0; i < n && vy + i < HEIGHT; i++) {
         /* Each line has 1 byte and is at the address pointed by
-         * the register I. */
-        uint8_t line = memory[reg_I + i];
-        /* Use a mask to extract each individual pixel of the
-         * 8-bit line and shift accordingly to isolate the bit. */
-        uint8_t mask, shift;
-        for (mask = 0x80, shift = 7; mask > 0; mask >>= 1, shift--) {
-            uint8_t old = get_pixel(vx, vy);
-            uint8_t new = xor_pixel(vx++, vy, (line & mask) >> shift);
-            /* Set VF register to 1 if the pixel was flipped from set (1)
-             * to unset (0). */
-            if (old == 1 && new == 0) reg[0xF] = 0x01;
-        }
-        /* Next line: reset x position and advance y position */ 
-        vx = ox; vy++; 
+         * the register I. Move it to the top of a screen row and then
+         * right to column vx; pixels past the right edge fall off. */
+        uint8_t line = c->memory[(c->reg_I + i) & 0xFFF];
+        uint64_t sprite = ((uint64_t)line << (WIDTH - 8)) >> vx;
+        uint64_t *row = &c->frame_buffer[vy + i];
+        /* Set VF register to 1 if any pixel is flipped from set (1)
+         * to unset (0). */
+        if (*row & sprite)
+            c->reg[0xF] = 0x01;
+        *row ^= sprite;
     }
 }
 
 /* EX9E     Skip the following instruction if the key corresponding 
  *          to the hex value currently stored in register VX is pressed.
  */
-void op_EX9E(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
+void op_EX9E(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
 
-    uint8_t vx = reg[x];
-    if (keys[vx] == 1)   
-        reg_PC = reg_PC + 2;
+    uint8_t vx = c->reg[x] & 0xF;   /* only keys 0-F exist */
+    c->keys_seen |= 1 << vx;
+    if (c->keys[vx] == 1)   
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* EXA1     Skip the following instruction if the key corresponding 
  *          to the hex value currently stored in register VX is not pressed.
  */
-void op_EXA1(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
+void op_EXA1(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
 
-    uint8_t vx = reg[x];
-    if (keys[vx] == 0)   
-        reg_PC = reg_PC + 2;
+    uint8_t vx = c->reg[x] & 0xF;
+    c->keys_seen |= 1 << vx;
+    if (c->keys[vx] == 0)   
+        c->reg_PC = c->reg_PC + 2;
 }
 
 /* FX07 	Store the current value of the delay timer in register VX.
  */
-void op_FX07(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    reg[x] = timer_delay;
+void op_FX07(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    c->reg[x] = c->timer_delay;
 }
 
 /* Helper function for instruction FX0A */
-int get_keypress() {
+int get_keypress(chip8_t *c) {
     /* Check if at least one key is pressed. The key registered
      * to register VX will be the first one in ascending order (0-F)
      * if multiple keys are pressed at the same time. */
     int k;
-    for (k = 0; k < sizeof(keys); k++) {
-        if (keys[k] > 0) {
+    for (k = 0; k < sizeof(c->keys); k++) {
+        if (c->keys[k] > 0) {
             return k;
         }
     }
@@ -339,90 +369,109 @@ int get_keypress() {
 
 /* FX0A 	Wait for a keypress and store the result in register VX.
  */
-void op_FX0A(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
+void op_FX0A(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
 
     /* If no keys are pressed, return the PC register to this same
      * instruction. This is our way to implement "waiting for a keypress" */
-    int key = get_keypress();
-    if (key > 0) {
-        reg[x] = key;
+    int key = get_keypress(c);
+    if (key >= 0) {
+        c->keys_seen |= 1 << key;
+        c->reg[x] = key;
     } else {
-        reg_PC = reg_PC - 2;
+        c->reg_PC = c->reg_PC - 2;
     }
 }
 
 /* FX15 	Set the delay timer to the value of register VX.
  */
-void op_FX15(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    timer_delay = reg[x];
+void op_FX15(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    c->timer_delay = c->reg[x];
 }
 
 /* FX18 	Set the sound timer to the value of register VX.
  */
-void op_FX18(uint16_t opcode) {
-    uint8_t x  = (opcode & 0x0F00) >> 8;
-    timer_sound = reg[x];
+void op_FX18(chip8_t *c, const instr_t *in) {
+    uint8_t x  = in->x;
+    c->timer_sound = c->reg[x];
 }
 
 /* FX1E 	Add the value stored in register VX to register I.
  */
-void op_FX1E(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
+void op_FX1E(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
 
-    reg_I = reg_I + reg[x];
+    c->reg_I = c->reg_I + c->reg[x];
 }
 
 /* FX29 	Set I to the memory address of the sprite data corresponding 
  *          to the hexadecimal digit stored in register VX.
  */
-void op_FX29(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
+void op_FX29(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
     /* Fonts are contiguously stored in memory starting at 
      * base address FONT and have 5 bytes each. */
-    reg_I = FONT + reg[x] * 5; 
+    c->reg_I = FONT + c->reg[x] * 5; 
+}
+
+/* Helper function for instructions FX33 and FX55.
+ * "n" bytes were written from I on, wrapping around the end of memory
+ * like every access through I: drop the decoded instructions there. */
+void invalidate_at_I(chip8_t *c, uint16_t n) {
+    uint16_t address = c->reg_I & 0xFFF;
+    if (address + n > 0x1000) {
+        cpu_invalidate(c, 0, address + n - 0x1000);
+        n = 0x1000 - address;
+    }
+    cpu_invalidate(c, address, n);
 }
 
 /* FX33     Store the binary-coded decimal equivalent of the value stored 
  *          in register VX at addresses I, I+1, and I+2.
  */
-void op_FX33(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
-    uint8_t vx = reg[x];
+void op_FX33(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
+    uint8_t vx = c->reg[x];
     /* VX is converted to its decimal equivalent; because data registers are
      * only 8-bits, there are 3 decimal digits maximum.
      * The most significant digit is stored in memory adress I, 
      * the decimal in I+1 and unit in I+2. */
-    memory[reg_I]   = vx / 100;             /* hundreds */
-    memory[reg_I+1] = (vx / 10) % 10;       /* decimal */
-    memory[reg_I+2] = vx % 10;              /* unit */
+    c->memory[c->reg_I & 0xFFF]       = vx / 100;         /* hundreds */
+    c->memory[(c->reg_I + 1) & 0xFFF] = (vx / 10) % 10;   /* decimal */
+    c->memory[(c->reg_I + 2) & 0xFFF] = vx % 10;          /* unit */
+
+    /* Code may have been overwritten: drop its decoded instructions. */
+    invalidate_at_I(c, 3);
 }
 
 /* FX55     Store the values of registers V0 to VX inclusive in memory 
  *          starting at address I.
  *          I is set to I + X + 1 after operation.
  */
-void op_FX55(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
+void op_FX55(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
 
     int i;
     for (i = 0; i <= x; i++)
-        memory[reg_I+i] = reg[i];
+        c->memory[(c->reg_I + i) & 0xFFF] = c->reg[i];
+
+    /* Code may have been overwritten: drop its decoded instructions. */
+    invalidate_at_I(c, x + 1);
 
-    reg_I = reg_I + x + 1;
+    c->reg_I = c->reg_I + x + 1;
 }
 
 /* FX65     Fill registers V0 to VX inclusive with the values stored in memory 
  *          starting at address I.
  *          I is set to I + X + 1 after operation.
  */
-void op_FX65(uint16_t opcode) {
-    uint8_t x = (opcode & 0x0F00) >> 8;
+void op_FX65(chip8_t *c, const instr_t *in) {
+    uint8_t x = in->x;
 
     int i;
     for (i = 0; i <= x; i++)
-        reg[i] = memory[reg_I+i];
+        c->reg[i] = c->memory[(c->reg_I + i) & 0xFFF];
 
-    reg_I = reg_I + x + 1;
+    c->reg_I = c->reg_I + x + 1;
 }
@@ -1,33 +1,90 @@
+#ifndef INSTR_H
+#define INSTR_H
+
 #include "chip8.h"
 
+/* Instruction ids, one per handler */
+enum {
+    OP_INVALID,
+    OP_DECODE,
+    OP_00E0,
+    OP_00EE,
+    OP_1NNN,
+    OP_2NNN,
+    OP_3XNN,
+    OP_4XNN,
+    OP_5XY0,
+    OP_6XNN,
+    OP_7XNN,
+    OP_8XY0,
+    OP_8XY1,
+    OP_8XY2,
+    OP_8XY3,
+    OP_8XY4,
+    OP_8XY5,
+    OP_8XY6,
+    OP_8XY7,
+    OP_8XYE,
+    OP_9XY0,
+    OP_ANNN,
+    OP_BNNN,
+    OP_CXNN,
+    OP_DXYN,
+    OP_EX9E,
+    OP_EXA1,
+    OP_FX07,
+    OP_FX0A,
+    OP_FX15,
+    OP_FX18,
+    OP_FX1E,
+    OP_FX29,
+    OP_FX33,
+    OP_FX55,
+    OP_FX65,
+    NOPS
+};
+
+extern op_t ops[NOPS];
+
 /* Instructions */
-void op_00E0(uint16_t opcode);
-void op_00EE(uint16_t opcode);
-void op_1NNN(uint16_t opcode);
-void op_2NNN(uint16_t opcode);
-void op_3XNN(uint16_t opcode);
-void op_4XNN(uint16_t opcode);
-void op_5XY0(uint16_t opcode);
-void op_6XNN(uint16_t opcode);
-void op_7XNN(uint16_t opcode);
-void op_8XYN(uint16_t opcode);
-void op_9XY0(uint16_t opcode);
-void op_ANNN(uint16_t opcode);
-void op_BNNN(uint16_t opcode);
-void op_CXNN(uint16_t opcode);
-void op_DXYN(uint16_t opcode);
-void op_EX9E(uint16_t opcode);
-void op_EXA1(uint16_t opcode);
-void op_FX07(uint16_t opcode);
-void op_FX0A(uint16_t opcode);
-void op_FX15(uint16_t opcode);
-void op_FX18(uint16_t opcode);
-void op_FX1E(uint16_t opcode);
-void op_FX29(uint16_t opcode);
-void op_FX33(uint16_t opcode);
-void op_FX55(uint16_t opcode);
-void op_FX65(uint16_t opcode);
+void op_00E0(chip8_t *c, const instr_t *in);
+void op_00EE(chip8_t *c, const instr_t *in);
+void op_1NNN(chip8_t *c, const instr_t *in);
+void op_2NNN(chip8_t *c, const instr_t *in);
+void op_3XNN(chip8_t *c, const instr_t *in);
+void op_4XNN(chip8_t *c, const instr_t *in);
+void op_5XY0(chip8_t *c, const instr_t *in);
+void op_6XNN(chip8_t *c, const instr_t *in);
+void op_7XNN(chip8_t *c, const instr_t *in);
+void op_8XY0(chip8_t *c, const instr_t *in);
+void op_8XY1(chip8_t *c, const instr_t *in);
+void op_8XY2(chip8_t *c, const instr_t *in);
+void op_8XY3(chip8_t *c, const instr_t *in);
+void op_8XY4(chip8_t *c, const instr_t *in);
+void op_8XY5(chip8_t *c, const instr_t *in);
+void op_8XY6(chip8_t *c, const instr_t *in);
+void op_8XY7(chip8_t *c, const instr_t *in);
+void op_8XYE(chip8_t *c, const instr_t *in);
+void op_9XY0(chip8_t *c, const instr_t *in);
+void op_ANNN(chip8_t *c, const instr_t *in);
+void op_BNNN(chip8_t *c, const instr_t *in);
+void op_CXNN(chip8_t *c, const instr_t *in);
+void op_DXYN(chip8_t *c, const instr_t *in);
+void op_EX9E(chip8_t *c, const instr_t *in);
+void op_EXA1(chip8_t *c, const instr_t *in);
+void op_FX07(chip8_t *c, const instr_t *in);
+void op_FX0A(chip8_t *c, const instr_t *in);
+void op_FX15(chip8_t *c, const instr_t *in);
+void op_FX18(chip8_t *c, const instr_t *in);
+void op_FX1E(chip8_t *c, const instr_t *in);
+void op_FX29(chip8_t *c, const instr_t *in);
+void op_FX33(chip8_t *c, const instr_t *in);
+void op_FX55(chip8_t *c, const instr_t *in);
+void op_FX65(chip8_t *c, const instr_t *in);
+void op_invalid(chip8_t *c, const instr_t *in);
+void op_decode(chip8_t *c, const instr_t *in);
 
 /* Helper functions to draw on screen */
-uint8_t xor_pixel(uint8_t x, uint8_t y, uint8_t p);
-uint8_t get_pixel(uint8_t x, uint8_t y); 
+uint8_t get_pixel(chip8_t *c, uint8_t x, uint8_t y);
+
+#endif
@@ -0,0 +1,527 @@
+/* x86-64 basic-block recompiler.
+ *
+ * Straight-line runs of CHIP-8 instructions are translated to native code
+ * the first time they execute and cached by start address. A block ends
+ * after any instruction that can change PC (jumps, calls, returns, skips,
+ * FX0A) or write memory (FX33, FX55), or after JIT_MAX_BLOCK instructions.
+ *
+ * Register, I and timer moves are emitted inline; everything else calls
+ * the same handlers the interpreters use, with PC stored beforehand
+ * exactly as cpu_update would have left it, so every instruction behaves
+ * as in instr.c.
+ *
+ * Memory is split in JIT_GRANULE byte granules. When FX33 or FX55 write
+ * over compiled code, the blocks there are dropped and the granule is
+ * marked dirty: from then on it is always interpreted, so self-modifying
+ * code never runs stale translations.
+ *
+ * Every instruction of a block is also an entry point: a frame that ran
+ * out of cycles in the middle of a block resumes right there next frame,
+ * without translating a new block. Blocks are entered through a shared
+ * trampoline, enter(c, code), which keeps the machine in rbx for the
+ * block and returns once the block ends. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "instr.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE   (256 * 1024)    /* bytes of native code per machine */
+#define JIT_SLOTS       8192            /* decoded instructions used by code */
+#define JIT_MAX_BLOCK   64              /* instructions per block */
+#define JIT_MAX_EMIT    48              /* native bytes per instruction */
+#define JIT_GRANULE     64              /* bytes per self-modification unit */
+
+typedef void (*enter_fn)(chip8_t *c, const uint8_t *code);
+
+/* Translated instruction: where its native code starts, which block it
+ * belongs to and how many instructions run from it to the block end. */
+typedef struct {
+    const uint8_t *code;    /* NULL if not translated */
+    uint16_t block;         /* start address of its block */
+    uint16_t remaining;
+} entry_t;
+
+/* Address range [start, end) of a block; end is 0 if there is none. */
+typedef struct {
+    uint16_t start;
+    uint16_t end;
+} block_t;
+
+struct jit {
+    uint8_t  *code;     /* NULL if executable memory is not available */
+    size_t    used;
+    enter_fn  enter;    /* trampoline at the start of the code buffer */
+    instr_t  *slots;    /* instructions passed to handlers from blocks */
+    int       nslots;
+    entry_t   entries[0x1000 / 2];  /* by address / 2 */
+    block_t   blocks[0x1000 / 2];   /* by start address / 2 */
+    uint64_t  code_mask;            /* granules holding compiled code */
+    uint64_t  dirty;                /* granules overwritten by the program */
+};
+
+#define GRANULE(address)    (1ULL << ((address) / JIT_GRANULE))
+
+/* Mask of the granules overlapping [start, end). */
+static uint64_t granules(uint32_t start, uint32_t end) {
+    uint64_t mask = 0;
+    uint32_t g;
+    for (g = start / JIT_GRANULE; g <= (end - 1) / JIT_GRANULE; g++)
+        mask |= 1ULL << g;
+    return mask;
+}
+
+/* Offsets of the machine fields used by native code. */
+#define OFF_REG(x)      (offsetof(chip8_t, reg) + (x))
+#define OFF_I           offsetof(chip8_t, reg_I)
+#define OFF_PC          offsetof(chip8_t, reg_PC)
+#define OFF_DELAY       offsetof(chip8_t, timer_delay)
+#define OFF_SOUND       offsetof(chip8_t, timer_sound)
+
+/* Native code emitter */
+
+static uint8_t *emit8(uint8_t *p, uint8_t b) {
+    *p++ = b;
+    return p;
+}
+
+static uint8_t *emit16(uint8_t *p, uint16_t w) {
+    memcpy(p, &w, 2);
+    return p + 2;
+}
+
+static uint8_t *emit32(uint8_t *p, uint32_t d) {
+    memcpy(p, &d, 4);
+    return p + 4;
+}
+
+static uint8_t *emit64(uint8_t *p, uint64_t q) {
+    memcpy(p, &q, 8);
+    return p + 8;
+}
+
+/* op byte [rbx+off], imm8 */
+static uint8_t *emit_mem8_imm(uint8_t *p, uint8_t op, uint8_t modrm, size_t off, uint8_t imm) {
+    p = emit8(p, op);
+    p = emit8(p, modrm);
+    p = emit32(p, off);
+    return emit8(p, imm);
+}
+
+/* op [rbx+off], al (or the reverse, depending on op) */
+static uint8_t *emit_mem8_al(uint8_t *p, uint8_t op, size_t off) {
+    p = emit8(p, op);
+    p = emit8(p, 0x83);
+    return emit32(p, off);
+}
+
+/* movzx eax, byte [rbx+off] */
+static uint8_t *emit_load8(uint8_t *p, size_t off) {
+    p = emit8(p, 0x0F);
+    p = emit8(p, 0xB6);
+    p = emit8(p, 0x83);
+    return emit32(p, off);
+}
+
+/* mov word [rbx+off], imm16 */
+static uint8_t *emit_store16_imm(uint8_t *p, size_t off, uint16_t imm) {
+    p = emit8(p, 0x66);
+    p = emit8(p, 0xC7);
+    p = emit8(p, 0x83);
+    p = emit32(p, off);
+    return emit16(p, imm);
+}
+
+/* op word [rbx+off], ax */
+static uint8_t *emit_mem16_ax(uint8_t *p, uint8_t op, size_t off) {
+    p = emit8(p, 0x66);
+    return emit_mem8_al(p, op, off);
+}
+
+/* setcc al; mov [VF], al */
+static uint8_t *emit_setcc_vf(uint8_t *p, uint8_t setcc) {
+    p = emit8(p, 0x0F);
+    p = emit8(p, setcc);
+    p = emit8(p, 0xC0);
+    return emit_mem8_al(p, 0x88, OFF_REG(0xF));
+}
+
+/* Conditional skip: flags were set by a compare; store next, and
+ * next + 2 unless the jump (jcc) over that second store is taken. */
+static uint8_t *emit_skip(uint8_t *p, uint8_t jcc, uint16_t next) {
+    p = emit_store16_imm(p, OFF_PC, next);
+    p = emit8(p, jcc);
+    p = emit8(p, 9);    /* size of the store below */
+    return emit_store16_imm(p, OFF_PC, next + 2);
+}
+
+/* Call the handler of "in", with PC already past the instruction. */
+static uint8_t *emit_call(uint8_t *p, const instr_t *in, uint16_t next) {
+    p = emit_store16_imm(p, OFF_PC, next);
+    p = emit8(p, 0x48); p = emit8(p, 0x89); p = emit8(p, 0xDF);    /* mov rdi, rbx */
+    p = emit8(p, 0x48); p = emit8(p, 0xBE);                         /* mov rsi, in */
+    p = emit64(p, (uint64_t)(uintptr_t)in);
+    p = emit8(p, 0x48); p = emit8(p, 0xB8);                         /* mov rax, op */
+    p = emit64(p, (uint64_t)(uintptr_t)in->op);
+    p = emit8(p, 0xFF); p = emit8(p, 0xD0);                         /* call rax */
+    return p;
+}
+
+/* Translate one instruction; set *end if it must end the block. */
+static uint8_t *emit_instr(uint8_t *p, struct jit *j, const instr_t *in,
+        uint16_t next, int *end) {
+    *end = 0;
+    switch (in->id) {
+        case OP_6XNN:   /* mov byte [Vx], nn */
+            return emit_mem8_imm(p, 0xC6, 0x83, OFF_REG(in->x), in->nn);
+        case OP_7XNN:   /* add byte [Vx], nn */
+            return emit_mem8_imm(p, 0x80, 0x83, OFF_REG(in->x), in->nn);
+        case OP_8XY0:   /* Vx = Vy */
+            p = emit_load8(p, OFF_REG(in->y));
+            return emit_mem8_al(p, 0x88, OFF_REG(in->x));
+        case OP_8XY1:   /* Vx |= Vy */
+            p = emit_load8(p, OFF_REG(in->y));
+            return emit_mem8_al(p, 0x08, OFF_REG(in->x));
+        case OP_8XY2:   /* Vx &= Vy */
+            p = emit_load8(p, OFF_REG(in->y));
+            return emit_mem8_al(p, 0x20, OFF_REG(in->x));
+        case OP_8XY3:   /* Vx ^= Vy */
+            p = emit_load8(p, OFF_REG(in->y));
+            return emit_mem8_al(p, 0x30, OFF_REG(in->x));
+        case OP_8XY4:   /* Vx += Vy; setc VF */
+            p = emit_load8(p, OFF_REG(in->y));
+            p = emit_mem8_al(p, 0x00, OFF_REG(in->x));
+            return emit_setcc_vf(p, 0x92);
+        /* The next ones write VF before (8XY5, 8XY7) or after (8XY6, 8XYE)
+         * reading their operands; when VF is an operand, leave the exact
+         * order to the handler. */
+        case OP_8XY5:   /* Vx -= Vy; setnc VF */
+            if (in->x == 0xF || in->y == 0xF)
+                break;
+            p = emit_load8(p, OFF_REG(in->y));
+            p = emit_mem8_al(p, 0x28, OFF_REG(in->x));
+            return emit_setcc_vf(p, 0x93);
+        case OP_8XY7:   /* al = Vy - Vx; Vx = al; setnc VF */
+            if (in->x == 0xF || in->y == 0xF)
+                break;
+            p = emit_load8(p, OFF_REG(in->y));
+            p = emit_mem8_al(p, 0x2A, OFF_REG(in->x));
+            p = emit_mem8_al(p, 0x88, OFF_REG(in->x));
+            return emit_setcc_vf(p, 0x93);
+        case OP_8XY6:   /* shr byte [Vx], 1; setc VF */
+            if (in->x == 0xF)
+                break;
+            p = emit8(p, 0xD0); p = emit8(p, 0xAB); p = emit32(p, OFF_REG(in->x));
+            return emit_setcc_vf(p, 0x92);
+        case OP_8XYE:   /* shl byte [Vx], 1; setc VF */
+            if (in->x == 0xF)
+                break;
+            p = emit8(p, 0xD0); p = emit8(p, 0xA3); p = emit32(p, OFF_REG(in->x));
+            return emit_setcc_vf(p, 0x92);
+        case OP_ANNN:   /* I = nnn */
+            return emit_store16_imm(p, OFF_I, in->nnn);
+        case OP_FX07:   /* Vx = delay */
+            p = emit_load8(p, OFF_DELAY);
+            return emit_mem8_al(p, 0x88, OFF_REG(in->x));
+        case OP_FX15:   /* delay = Vx */
+            p = emit_load8(p, OFF_REG(in->x));
+            return emit_mem8_al(p, 0x88, OFF_DELAY);
+        case OP_FX18:   /* sound = Vx */
+            p = emit_load8(p, OFF_REG(in->x));
+            return emit_mem8_al(p, 0x88, OFF_SOUND);
+        case OP_FX1E:   /* I += Vx */
+            p = emit_load8(p, OFF_REG(in->x));
+            return emit_mem16_ax(p, 0x01, OFF_I);
+        case OP_FX29:   /* I = FONT + Vx * 5 */
+            p = emit_load8(p, OFF_REG(in->x));
+            p = emit8(p, 0x8D); p = emit8(p, 0x04); p = emit8(p, 0x80);  /* lea eax, [rax+rax*4] */
+            p = emit8(p, 0x66); p = emit8(p, 0x05); p = emit16(p, FONT); /* add ax, FONT */
+            return emit_mem16_ax(p, 0x89, OFF_I);
+
+        case OP_1NNN:
+            *end = 1;
+            /* Out of range targets go through the handler, which faults. */
+            if (in->nnn < 0x200)
+                break;
+            return emit_store16_imm(p, OFF_PC, in->nnn);
+        case OP_3XNN:   /* cmp byte [Vx], nn; skip if equal */
+            *end = 1;
+            p = emit_mem8_imm(p, 0x80, 0xBB, OFF_REG(in->x), in->nn);
+            return emit_skip(p, 0x75, next);
+        case OP_4XNN:   /* skip if not equal */
+            *end = 1;
+            p = emit_mem8_imm(p, 0x80, 0xBB, OFF_REG(in->x), in->nn);
+            return emit_skip(p, 0x74, next);
+        case OP_5XY0:   /* cmp [Vx], Vy; skip if equal */
+            *end = 1;
+            p = emit_load8(p, OFF_REG(in->y));
+            p = emit_mem8_al(p, 0x38, OFF_REG(in->x));
+            return emit_skip(p, 0x75, next);
+        case OP_9XY0:   /* skip if not equal */
+            *end = 1;
+            p = emit_load8(p, OFF_REG(in->y));
+            p = emit_mem8_al(p, 0x38, OFF_REG(in->x));
+            return emit_skip(p, 0x74, next);
+
+        /* Handlers that end the block: they change PC or write memory. */
+        case OP_00EE:
+        case OP_2NNN:
+        case OP_BNNN:
+        case OP_EX9E:
+        case OP_EXA1:
+        case OP_FX0A:
+        case OP_FX33:
+        case OP_FX55:
+        case OP_INVALID:
+            *end = 1;
+            break;
+    }
+
+    /* Not translated: call the handler, which needs the instruction to
+     * outlive the decode cache entry, so it gets its own copy. */
+    instr_t *slot = &j->slots[j->nslots++];
+    *slot = *in;
+    return emit_call(p, slot, next);
+}
+
+/* Drop every block; used when the code buffer runs out of space. */
+static void jit_flush(struct jit *j) {
+    /* Only granules holding compiled code have entries and blocks set. */
+    int g, per = JIT_GRANULE / 2;
+    for (g = 0; g < 64; g++) {
+        if (j->code_mask & (1ULL << g)) {
+            memset(&j->entries[g * per], 0, per * sizeof(entry_t));
+            memset(&j->blocks[g * per], 0, per * sizeof(block_t));
+        }
+    }
+    j->nslots = 0;
+    j->code_mask = 0;
+    j->used = 0;
+    if (j->code == NULL)
+        return;
+
+    /* enter(c, code): push rbx; mov rbx, rdi; jmp rsi.
+     * The block pops rbx and returns straight to the caller. */
+    uint8_t *p = j->code;
+    p = emit8(p, 0x53);
+    p = emit8(p, 0x48); p = emit8(p, 0x89); p = emit8(p, 0xFB);
+    p = emit8(p, 0xFF); p = emit8(p, 0xE6);
+    j->enter = (enter_fn)(void *)j->code;
+    j->used = p - j->code;
+}
+
+/* Translate the block starting at "pc". Return its first entry, or NULL
+ * if it cannot be translated (self-modified code, or no executable
+ * memory). */
+static entry_t *jit_compile(chip8_t *c, struct jit *j, uint16_t pc) {
+    if (j->code == NULL || (j->dirty & GRANULE(pc)))
+        return NULL;
+    if (j->used + JIT_MAX_BLOCK * JIT_MAX_EMIT + 32 > JIT_CODE_SIZE ||
+            j->nslots + JIT_MAX_BLOCK > JIT_SLOTS)
+        jit_flush(j);
+
+    uint8_t *start = j->code + j->used;
+    uint8_t *p = start;
+    uint8_t *code[JIT_MAX_BLOCK];
+
+    uint16_t address = pc;
+    int n = 0, end = 0;
+    while (!end) {
+        /* Stop before dirty memory, the end of memory or a full block;
+         * the next block starts right there. */
+        if (address > 0xFFE || n == JIT_MAX_BLOCK ||
+                (j->dirty & (GRANULE(address) | GRANULE(address + 1)))) {
+            p = emit_store16_imm(p, OFF_PC, address);
+            break;
+        }
+        instr_t in;
+        cpu_decode(cpu_fetch(c, address), &in);
+        code[n++] = p;
+        p = emit_instr(p, j, &in, address + 2, &end);
+        address = address + 2;
+    }
+    p = emit8(p, 0x5B);                                 /* pop rbx */
+    p = emit8(p, 0xC3);                                 /* ret */
+    j->used += p - start;
+
+    /* A newer block takes over the entries it shares with older ones. */
+    int i;
+    for (i = 0; i < n; i++) {
+        entry_t *e = &j->entries[(pc >> 1) + i];
+        e->code = code[i];
+        e->block = pc;
+        e->remaining = n - i;
+    }
+    j->blocks[pc >> 1].start = pc;
+    j->blocks[pc >> 1].end = address;
+    j->code_mask |= granules(pc, address);
+    return &j->entries[pc >> 1];
+}
+
+/* Set up the recompiler of "c"; return NULL if there is no memory for it. */
+static struct jit *jit_create(chip8_t *c) {
+    struct jit *j = calloc(1, sizeof(struct jit));
+    if (j == NULL)
+        return NULL;
+    j->slots = malloc(JIT_SLOTS * sizeof(instr_t));
+    if (j->slots == NULL) {
+        free(j);
+        return NULL;
+    }
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* Without executable memory the machine is simply interpreted. */
+    if (j->code == MAP_FAILED)
+        j->code = NULL;
+    jit_flush(j);
+    c->jit = j;
+    return j;
+}
+
+/* Forget all blocks and self-modification history, after a reset. */
+void jit_reset(chip8_t *c) {
+    if (c->jit) {
+        jit_flush(c->jit);
+        c->jit->dirty = 0;
+    }
+}
+
+void jit_free(chip8_t *c) {
+    struct jit *j = c->jit;
+    if (j) {
+        if (j->code)
+            munmap(j->code, JIT_CODE_SIZE);
+        free(j->slots);
+        free(j);
+        c->jit = NULL;
+    }
+}
+
+/* Memory in [address, address + size) was written: drop the blocks
+ * overlapping it and interpret those granules from now on. */
+void jit_invalidate(chip8_t *c, uint16_t address, uint16_t size) {
+    struct jit *j = c->jit;
+    uint32_t end = (uint32_t)address + size;
+    if (end > 0x1000)
+        end = 0x1000;
+    /* Most writes are data far from any code. */
+    if (address >= end || !(j->code_mask & granules(address, end)))
+        return;
+
+    /* Only blocks starting at most JIT_MAX_BLOCK instructions before the
+     * written range can overlap it. */
+    int first = (int)address - 2 * JIT_MAX_BLOCK;
+    if (first < 0)
+        first = 0;
+    int a;
+    for (a = first & ~1; a < (int)end; a += 2) {
+        block_t *b = &j->blocks[a >> 1];
+        if (b->end == 0 || b->start >= end || b->end <= address)
+            continue;
+        int e;
+        for (e = b->start; e < b->end; e += 2)
+            if (j->entries[e >> 1].block == b->start)
+                j->entries[e >> 1].code = NULL;
+        j->dirty |= granules(b->start, b->end);
+        b->end = 0;
+    }
+}
+
+/* Memory in the granules set in "mask" was replaced as a whole (a state
+ * was restored): it was not modified by the program itself, so drop the
+ * translations and forget the self-modification history there. */
+void jit_reload(chip8_t *c, uint64_t mask) {
+    struct jit *j = c->jit;
+    if (j->code_mask & mask)
+        jit_flush(j);
+    j->dirty &= ~mask;
+}
+
+/* Translate the block starting at "address" ahead of its first run, e.g.
+ * from a static analysis of the image. Blocks already translated are left
+ * alone, and so is everything once the code buffer is full: flushing it
+ * here would only throw away earlier blocks. */
+void jit_precompile(chip8_t *c, uint16_t address) {
+    struct jit *j = c->jit ? c->jit : jit_create(c);
+    if (j == NULL || (address & 0xF001) != 0 ||
+            j->entries[address >> 1].code != NULL)
+        return;
+    if (j->used + JIT_MAX_BLOCK * JIT_MAX_EMIT + 32 > JIT_CODE_SIZE ||
+            j->nslots + JIT_MAX_BLOCK > JIT_SLOTS)
+        return;
+    jit_compile(c, j, address);
+}
+
+void cpu_update_jit(chip8_t *c, int cycles) {
+#ifdef CHIP8_STATS
+    /* Compiled blocks do not count: interpret while counting. */
+    if (c->stats) {
+        cpu_update_threaded(c, cycles);
+        return;
+    }
+#endif
+    struct jit *j = c->jit ? c->jit : jit_create(c);
+    /* Without memory for the recompiler, the machine is interpreted. */
+    if (j == NULL) {
+        cpu_update_threaded(c, cycles);
+        return;
+    }
+
+    while (cycles > 0) {
+        uint16_t pc = c->reg_PC;
+        entry_t *e = NULL;
+        if ((pc & 0xF001) == 0) {
+            e = &j->entries[pc >> 1];
+            if (e->code == NULL)
+                e = jit_compile(c, j, pc);
+        }
+        if (e == NULL) {
+            /* Odd address or self-modified code: interpret a single
+             * instruction, the next one may well be translated. */
+            cpu_update_threaded(c, 1);
+            cycles--;
+        } else if (e->remaining > cycles) {
+            /* Not enough cycles left to finish the block: interpret the
+             * rest of them; the next call resumes inside the block. */
+            cpu_update_threaded(c, cycles);
+            cycles = 0;
+        } else {
+            cycles -= e->remaining;
+            j->enter(c, e->code);
+            /* Jumped back to this block or before it: this may be an
+             * idle loop. */
+            if (c->reg_PC <= pc && --c->idle_countdown <= 0)
+                cycles -= cpu_idle(c, cycles);
+        }
+    }
+}
+
+#else
+
+/* No recompiler for this platform: run the threaded interpreter. */
+void cpu_update_jit(chip8_t *c, int cycles) {
+    cpu_update_threaded(c, cycles);
+}
+
+void jit_reset(chip8_t *c) {
+}
+
+void jit_free(chip8_t *c) {
+}
+
+void jit_invalidate(chip8_t *c, uint16_t address, uint16_t size) {
+}
+
+void jit_reload(chip8_t *c, uint64_t mask) {
+}
+
+void jit_precompile(chip8_t *c, uint16_t address) {
+}
+
+#endif
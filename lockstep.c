@@ -0,0 +1,498 @@
+/* Lockstep engine: many machines running the same image, one instruction
+ * for all of them per step.
+ *
+ * Lanes are grouped in blocks of LANES machines. A block keeps the
+ * registers, I, PC, the stack, the timers, the keys and the random number
+ * generator of its lanes as structure of arrays, one array of LANES
+ * entries per register, so that an instruction runs for every lane of the
+ * block as a short loop over those arrays, which the compiler turns into
+ * SIMD code (lockstep.o is built with -O3 for that).
+ *
+ * Lanes at the same PC run the instruction there as a group, masked so
+ * that the other lanes keep their state; as long as the lanes have not
+ * diverged, that is one group per block and step. Each lane also has a
+ * machine of its own, which holds everything else (memory, frame buffer,
+ * fault...): drawing and loading from memory go through a loop over the
+ * lanes of the group on their machines. Writing to memory, faults, small
+ * groups and lanes that overwrote the code at their PC run lane by lane
+ * instead: the registers of the lane are copied into its machine, the
+ * handler runs there, and the registers are copied back.
+ *
+ * Every lane ends up in the very state a machine of its own would reach
+ * with cpu_update, except that idle loops are not skipped. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "instr.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Lanes per block. */
+#define LANES       32
+
+/* Groups smaller than this run lane by lane. */
+#define MIN_GROUP   4
+
+/* 64-byte granule of memory holding "address", as a bit. */
+#define GRANULE(address)    (1ULL << (((address) & 0xFFF) >> 6))
+
+/* Masks are 0xFF for the lanes in them, 0 for the others. */
+typedef struct {
+    uint8_t  reg[16][LANES];
+    uint8_t  timer_delay[LANES];
+    uint8_t  timer_sound[LANES];
+    uint8_t  keys[16][LANES];
+    uint8_t  sp[LANES];
+    uint8_t  used[LANES];       /* mask of the lanes holding a machine */
+    uint16_t reg_I[LANES];
+    uint16_t reg_PC[LANES];
+    uint16_t stack[LEVELS][LANES];
+    uint32_t rng[LANES];
+    uint64_t dirty;             /* granules written by any lane */
+} block_t;
+
+struct lockstep {
+    int       n;                /* lanes */
+    int       nblocks;
+    block_t  *blocks;
+    chip8_t  *machines;         /* everything else, one machine per lane */
+    uint64_t *dirty;            /* granules written, per lane */
+    /* Memory of every lane right after loading, and its decoded
+     * instructions (decoded on first use), shared by the lanes until they
+     * write to their code. */
+    uint8_t   image[0x1000];
+    instr_t   decoded[0x1000 / 2];
+};
+
+/* For every lane "l" of the block. */
+#define LANE_LOOP   for (l = 0; l < LANES; l++)
+
+/* Lanes of mask "m" as bits, lane 0 in the least significant one. */
+static uint32_t lane_bits(const uint8_t *m) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)m)) |
+        (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(m + 16))) << 16;
+#else
+    uint32_t bits = 0;
+    int l;
+    LANE_LOOP
+        bits |= (uint32_t)(m[l] & 1) << l;
+    return bits;
+#endif
+}
+
+/* Create a batch of "n" machines; return NULL if "n" is less than one or
+ * there is no memory for them. */
+lockstep_t *lockstep_create(int n) {
+    if (n < 1)
+        return NULL;
+    lockstep_t *g = calloc(1, sizeof(lockstep_t));
+    if (g == NULL)
+        return NULL;
+    g->n = n;
+    g->nblocks = (n + LANES - 1) / LANES;
+    g->blocks = calloc(g->nblocks, sizeof(block_t));
+    g->machines = calloc(n, sizeof(chip8_t));
+    g->dirty = calloc(n, sizeof(uint64_t));
+    if (g->blocks == NULL || g->machines == NULL || g->dirty == NULL) {
+        free(g->blocks);
+        free(g->machines);
+        free(g->dirty);
+        free(g);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < n; i++)
+        g->blocks[i / LANES].used[i % LANES] = 0xFF;
+    return g;
+}
+
+void lockstep_free(lockstep_t *g) {
+    if (g == NULL)
+        return;
+    int i;
+    for (i = 0; i < g->n; i++)
+        cpu_release(&g->machines[i]);
+    free(g->machines);
+    free(g->blocks);
+    free(g->dirty);
+    free(g);
+}
+
+/* Copy the registers of lane "i" from its block to its machine; with
+ * "full", the keys and the stack as well. */
+static void to_machine(lockstep_t *g, int i, int full) {
+    block_t *b = &g->blocks[i / LANES];
+    chip8_t *c = &g->machines[i];
+    int k, l = i % LANES;
+    for (k = 0; k < 16; k++)
+        c->reg[k] = b->reg[k][l];
+    c->reg_I = b->reg_I[l];
+    c->reg_PC = b->reg_PC[l];
+    c->timer_delay = b->timer_delay[l];
+    c->timer_sound = b->timer_sound[l];
+    c->rng = b->rng[l];
+    if (full) {
+        for (k = 0; k < 16; k++)
+            c->keys[k] = b->keys[k][l];
+        for (k = 0; k < LEVELS; k++)
+            c->stack[k] = b->stack[k][l];
+        c->sp = b->sp[l];
+    }
+}
+
+/* Copy the registers of lane "i" back from its machine to its block; with
+ * "full", the stack as well. */
+static void from_machine(lockstep_t *g, int i, int full) {
+    block_t *b = &g->blocks[i / LANES];
+    chip8_t *c = &g->machines[i];
+    int k, l = i % LANES;
+    for (k = 0; k < 16; k++)
+        b->reg[k][l] = c->reg[k];
+    b->reg_I[l] = c->reg_I;
+    b->reg_PC[l] = c->reg_PC;
+    b->timer_delay[l] = c->timer_delay;
+    b->timer_sound[l] = c->timer_sound;
+    b->rng[l] = c->rng;
+    if (full) {
+        for (k = 0; k < LEVELS; k++)
+            b->stack[k][l] = c->stack[k];
+        b->sp[l] = c->sp;
+    }
+}
+
+/* Reset every lane and load "size" bytes of "rom" into it.
+ * Return 0 on success or -1 if the image does not fit in memory. */
+int lockstep_load(lockstep_t *g, const uint8_t *rom, size_t size) {
+    int i;
+    for (i = 0; i < g->n; i++) {
+        chip8_t *c = &g->machines[i];
+        cpu_reset(c);
+        if (cpu_load(c, rom, size) < 0)
+            return -1;
+        from_machine(g, i, 1);
+        g->dirty[i] = 0;
+    }
+    for (i = 0; i < g->nblocks; i++) {
+        memset(g->blocks[i].keys, 0, sizeof(g->blocks[i].keys));
+        g->blocks[i].dirty = 0;
+    }
+    memcpy(g->image, g->machines[0].memory, sizeof(g->image));
+    for (i = 0; i < 0x1000 / 2; i++)
+        g->decoded[i] = (instr_t){ .op = op_decode, .id = OP_DECODE };
+    return 0;
+}
+
+/* Seed the random number generator of lane "i" (see cpu_seed). */
+void lockstep_seed(lockstep_t *g, int i, uint32_t seed) {
+    cpu_seed(&g->machines[i], seed);
+    g->blocks[i / LANES].rng[i % LANES] = g->machines[i].rng;
+}
+
+/* Set the keys pressed on lane "i": bit k of "mask" is key k. */
+void lockstep_keys(lockstep_t *g, int i, uint16_t mask) {
+    block_t *b = &g->blocks[i / LANES];
+    int k;
+    for (k = 0; k < 16; k++)
+        b->keys[k][i % LANES] = (mask >> k) & 1;
+}
+
+/* Decrement the timers of every lane (see cpu_tick_timers). */
+void lockstep_tick_timers(lockstep_t *g) {
+    int i, l;
+    for (i = 0; i < g->nblocks; i++) {
+        block_t *b = &g->blocks[i];
+        LANE_LOOP {
+            b->timer_delay[l] -= b->timer_delay[l] != 0;
+            b->timer_sound[l] -= b->timer_sound[l] != 0;
+        }
+    }
+}
+
+/* The whole machine of lane "i", registers included. It stays valid until
+ * the next lockstep_update; changes made to it are not seen by the lane. */
+chip8_t *lockstep_machine(lockstep_t *g, int i) {
+    to_machine(g, i, 1);
+    return &g->machines[i];
+}
+
+/* Run one instruction on lane "i" alone, on its own machine, the way the
+ * call engine does. */
+static void step_lane(lockstep_t *g, int i) {
+    chip8_t *c = &g->machines[i];
+    block_t *b = &g->blocks[i / LANES];
+    uint16_t pc = b->reg_PC[i % LANES], address = b->reg_I[i % LANES];
+    instr_t *in, odd;
+    if ((pc & 0xF001) == 0) {
+        in = &c->dcache[pc >> 1];
+    } else {
+        in = &odd;
+        cpu_decode(cpu_fetch(c, pc), in);
+    }
+    /* Only the instructions that read the keys or use the stack (or may
+     * turn out to, not decoded yet) get them. */
+    int id = in->id, full = id == OP_DECODE || id == OP_2NNN ||
+        id == OP_00EE || id == OP_EX9E || id == OP_EXA1 || id == OP_FX0A;
+    /* Bytes it writes, from the opcode: an instruction that overwrites
+     * itself leaves its cache entry undecoded. */
+    uint16_t opcode = cpu_fetch(c, pc);
+    int n = (opcode & 0xF0FF) == 0xF033 ? 3 :
+        (opcode & 0xF0FF) == 0xF055 ? ((opcode >> 8) & 0xF) + 1 : 0;
+    to_machine(g, i, full);
+    c->reg_PC = pc + 2;
+    in->op(c, in);
+
+    /* Memory written: the lane no longer runs the shared image there. */
+    while (n-- > 0) {
+        uint64_t granule = GRANULE(address + n);
+        g->dirty[i] |= granule;
+        b->dirty |= granule;
+    }
+    from_machine(g, i, full);
+}
+
+/* DXYN on machine "c" (see op_DXYN), with the operands read from the
+ * block; return the new VF. */
+static uint8_t draw_lane(chip8_t *c, uint8_t vx, uint8_t vy, uint16_t address,
+        uint8_t n) {
+    uint8_t flag = 0;
+    int i;
+    vx %= WIDTH;
+    vy %= HEIGHT;
+    c->dirty = 1;
+    c->writes++;
+    for (i = 0; i < n && vy + i < HEIGHT; i++) {
+        uint8_t line = c->memory[(address + i) & 0xFFF];
+        uint64_t sprite = ((uint64_t)line << (WIDTH - 8)) >> vx;
+        uint64_t *row = &c->frame_buffer[vy + i];
+        if (*row & sprite)
+            flag = 1;
+        *row ^= sprite;
+    }
+    return flag;
+}
+
+/* "a" if "mask" (0xFF or 0) is set, "b" otherwise: without branches, so
+ * that the loops around can be vectorized. */
+#define BLEND(mask, a, b) \
+    (((a) & (__typeof__(b))(int8_t)(mask)) | ((b) & ~(__typeof__(b))(int8_t)(mask)))
+
+/* Set "dst" to "value" in the lanes of "m". */
+#define SET(dst, value) LANE_LOOP dst[l] = BLEND(m[l], value, dst[l])
+
+/* Set PC of the lanes of "m" to "target", or to "next" plus 2 if "skip". */
+#define JUMP(target)    SET(b->reg_PC, target)
+#define SKIP(skip)      JUMP(next + 2 * (skip))
+
+/* Run "in", the instruction at "pc", on the lanes "m" of block "k", which
+ * are all at "pc". Return 0 (having changed nothing) if it has to run
+ * lane by lane. */
+static inline int step_group(lockstep_t *g, int k, const instr_t *in,
+        uint16_t pc, const uint8_t *m) {
+    block_t *b = &g->blocks[k];
+    chip8_t *machines = &g->machines[k * LANES];
+    uint8_t (*reg)[LANES] = b->reg;
+    uint8_t x = in->x, y = in->y, nn = in->nn;
+    uint16_t nnn = in->nnn, next = pc + 2;
+    uint8_t any = 0;
+    uint32_t bits;
+    int i, l;
+
+    switch (in->id) {
+        case OP_1NNN:
+            if (nnn < 0x200)
+                return 0;       /* fault */
+            JUMP(nnn);
+            return 1;
+        case OP_2NNN:
+            /* Push PC on the stack of every lane, at its own depth. */
+            LANE_LOOP any |= m[l] & (b->sp[l] >= LEVELS);
+            if (nnn < 0x200 || any)
+                return 0;       /* fault */
+            for (i = 0; i < LEVELS; i++)
+                LANE_LOOP b->stack[i][l] = BLEND(m[l] & -(b->sp[l] == i),
+                        next, b->stack[i][l]);
+            SET(b->sp, b->sp[l] + 1);
+            JUMP(nnn);
+            return 1;
+        case OP_00EE: {
+            LANE_LOOP any |= m[l] & (b->sp[l] == 0);
+            if (any)
+                return 0;       /* fault */
+            uint16_t target[LANES] = { 0 };
+            SET(b->sp, b->sp[l] - 1);
+            for (i = 0; i < LEVELS; i++)
+                LANE_LOOP target[l] |= BLEND(-(b->sp[l] == i), b->stack[i][l], 0);
+            JUMP(target[l]);
+            return 1;
+        }
+        case OP_3XNN: SKIP(reg[x][l] == nn); return 1;
+        case OP_4XNN: SKIP(reg[x][l] != nn); return 1;
+        case OP_5XY0: SKIP(reg[x][l] == reg[y][l]); return 1;
+        case OP_9XY0: SKIP(reg[x][l] != reg[y][l]); return 1;
+        case OP_EX9E:
+        case OP_EXA1: {
+            /* keys[VX & 0xF] of every lane. */
+            uint8_t key[LANES] = { 0 };
+            for (i = 0; i < 16; i++)
+                LANE_LOOP key[l] |= b->keys[i][l] & -((reg[x][l] & 0xF) == i);
+            if (in->id == OP_EX9E)
+                SKIP(key[l] == 1);
+            else
+                SKIP(key[l] == 0);
+            return 1;
+        }
+        case OP_FX0A: {
+            /* The first key pressed, if any (see get_keypress); with no
+             * key, the lane stays here. */
+            uint8_t key[LANES] = { 0 }, found[LANES] = { 0 };
+            for (i = 15; i >= 0; i--)
+                LANE_LOOP {
+                    uint8_t down = -(b->keys[i][l] > 0);
+                    key[l] = BLEND(down, i, key[l]);
+                    found[l] |= down;
+                }
+            SET(reg[x], BLEND(found[l], key[l], reg[x][l]));
+            JUMP(BLEND(found[l], next, pc));
+            return 1;
+        }
+        case OP_BNNN: JUMP(nnn + reg[0][l]); return 1;
+        /* The screen and memory are the lanes' own: one lane at a time,
+         * but right on the machine. */
+        case OP_00E0:
+            for (bits = lane_bits(m); bits; bits &= bits - 1) {
+                chip8_t *c = &machines[__builtin_ctz(bits)];
+                memset(c->frame_buffer, 0, sizeof(c->frame_buffer));
+                c->dirty = 1;
+                c->writes++;
+            }
+            break;
+        case OP_DXYN:
+            for (bits = lane_bits(m); bits; bits &= bits - 1) {
+                l = __builtin_ctz(bits);
+                reg[0xF][l] = draw_lane(&machines[l], reg[x][l], reg[y][l],
+                        b->reg_I[l], in->n);
+            }
+            break;
+        case OP_FX65:
+            for (bits = lane_bits(m); bits; bits &= bits - 1) {
+                l = __builtin_ctz(bits);
+                for (i = 0; i <= x; i++)
+                    reg[i][l] = machines[l].memory[(b->reg_I[l] + i) & 0xFFF];
+            }
+            SET(b->reg_I, b->reg_I[l] + x + 1);
+            break;
+        case OP_6XNN: SET(reg[x], nn); break;
+        case OP_7XNN: SET(reg[x], reg[x][l] + nn); break;
+        case OP_8XY0: SET(reg[x], reg[y][l]); break;
+        case OP_8XY1: SET(reg[x], reg[x][l] | reg[y][l]); break;
+        case OP_8XY2: SET(reg[x], reg[x][l] & reg[y][l]); break;
+        case OP_8XY3: SET(reg[x], reg[x][l] ^ reg[y][l]); break;
+        /* Flags: written in the same order as the handlers do, so that
+         * VF as an operand comes out the same. */
+        case OP_8XY4:
+            LANE_LOOP {
+                uint8_t vx = reg[x][l], sum = vx + reg[y][l];
+                reg[x][l] = BLEND(m[l], sum, vx);
+                reg[0xF][l] = BLEND(m[l], sum < vx, reg[0xF][l]);
+            }
+            break;
+        case OP_8XY5:
+            SET(reg[0xF], reg[y][l] <= reg[x][l]);
+            SET(reg[x], reg[x][l] - reg[y][l]);
+            break;
+        case OP_8XY6:
+            SET(reg[0xF], reg[x][l] & 1);
+            SET(reg[x], reg[x][l] >> 1);
+            break;
+        case OP_8XY7:
+            SET(reg[0xF], reg[x][l] <= reg[y][l]);
+            SET(reg[x], reg[y][l] - reg[x][l]);
+            break;
+        case OP_8XYE:
+            SET(reg[0xF], reg[x][l] >> 7);
+            SET(reg[x], reg[x][l] << 1);
+            break;
+        case OP_ANNN: SET(b->reg_I, nnn); break;
+        case OP_CXNN:
+            LANE_LOOP {
+                /* rng_next, on every lane. */
+                uint32_t r = b->rng[l];
+                r ^= r << 13;
+                r ^= r >> 17;
+                r ^= r << 5;
+                b->rng[l] = BLEND(m[l], r, b->rng[l]);
+                reg[x][l] = BLEND(m[l], (r >> 24) & nn, reg[x][l]);
+            }
+            break;
+        case OP_FX07: SET(reg[x], b->timer_delay[l]); break;
+        case OP_FX15: SET(b->timer_delay, reg[x][l]); break;
+        case OP_FX18: SET(b->timer_sound, reg[x][l]); break;
+        case OP_FX1E: SET(b->reg_I, b->reg_I[l] + reg[x][l]); break;
+        case OP_FX29: SET(b->reg_I, FONT + reg[x][l] * 5); break;
+        default:
+            /* Memory writes and invalid opcodes. */
+            return 0;
+    }
+    JUMP(next);
+    return 1;
+}
+
+/* Run one instruction on every lane of block "k". */
+static void step_block(lockstep_t *g, int k) {
+    block_t *b = &g->blocks[k];
+    uint8_t todo[LANES], m[LANES];
+    int l;
+    memcpy(todo, b->used, LANES);
+    uint32_t left = lane_bits(todo);
+    while (left) {
+        /* The lanes at the same PC as the first one left. */
+        uint16_t pc = b->reg_PC[__builtin_ctz(left)];
+        LANE_LOOP {
+            m[l] = todo[l] & -(b->reg_PC[l] == pc);
+            todo[l] &= ~m[l];
+        }
+        uint32_t group = lane_bits(m), alone = group;
+        left &= ~group;
+
+        if (__builtin_popcount(group) >= MIN_GROUP && (pc & 0xF001) == 0) {
+            /* Lanes that wrote to their code at PC run their own. */
+            alone = 0;
+            if (b->dirty & GRANULE(pc)) {
+                uint32_t bits = group;
+                while (bits) {
+                    l = __builtin_ctz(bits);
+                    bits &= bits - 1;
+                    if (g->dirty[k * LANES + l] & GRANULE(pc)) {
+                        alone |= 1u << l;
+                        m[l] = 0;
+                    }
+                }
+            }
+            instr_t *in = &g->decoded[pc >> 1];
+            if (in->id == OP_DECODE)
+                cpu_decode(g->image[pc] << 8 | g->image[pc + 1], in);
+            if (!step_group(g, k, in, pc, m))
+                alone = group;
+        }
+        while (alone) {
+            step_lane(g, k * LANES + __builtin_ctz(alone));
+            alone &= alone - 1;
+        }
+    }
+}
+
+/* Run "cycles" instructions on every lane. */
+void lockstep_update(lockstep_t *g, int cycles) {
+    int k, i;
+    /* Lanes are independent: run each block through all of them while it
+     * is in cache. */
+    for (k = 0; k < g->nblocks; k++)
+        for (i = 0; i < cycles; i++)
+            step_block(g, k);
+}
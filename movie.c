@@ -0,0 +1,171 @@
+/* Input movies: everything needed to replay a session exactly.
+ *
+ * A run is fully determined by the image, the RNG seed, the cycles per
+ * frame and the keys pressed during every frame; a movie records those,
+ * plus the number of frames and the hash of the final state, so that a
+ * replay can tell whether it ended up in the same place.
+ *
+ * Movie file (text):
+ *
+ *      chip8-movie 2
+ *      image <hash of memory 0x200-0xFFF after loading the image>
+ *      seed <seed>
+ *      cycles <cycles per frame>
+ *      frames <frames>
+ *      hash <final state hash>
+ *      <frame> <keys>
+ *      ...
+ *
+ * The "<frame> <keys>" lines are the same as in batch input scripts: keys
+ * is a hexadecimal bitmask that holds from that frame on, so only frames
+ * where the keys change are listed, and a movie can be used as a batch
+ * script as it is. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define MOVIE_VERSION   2
+
+/* Hash of the loaded image, to catch replays against the wrong one. */
+static uint64_t image_hash(chip8_t *c) {
+    return hash_bytes(&c->memory[0x200], sizeof(c->memory) - 0x200);
+}
+
+/* Keys currently pressed on "c" as a bitmask (bit k set = key k). */
+static uint16_t keys_mask(chip8_t *c) {
+    uint16_t mask = 0;
+    int k;
+    for (k = 0; k < 16; k++)
+        if (c->keys[k])
+            mask |= 1 << k;
+    return mask;
+}
+
+/* Return -1 if there is no memory for the event. */
+static int add_event(movie_t *m, int frame, uint16_t mask) {
+    if (m->nevents == m->capacity) {
+        int capacity = m->capacity ? 2 * m->capacity : 256;
+        movie_event_t *events = realloc(m->events,
+                                        capacity * sizeof(movie_event_t));
+        if (events == NULL)
+            return -1;
+        m->events = events;
+        m->capacity = capacity;
+    }
+    m->events[m->nevents].frame = frame;
+    m->events[m->nevents].mask = mask;
+    m->nevents++;
+    return 0;
+}
+
+/* Start recording on "c", whose image must be loaded already; "c" is
+ * seeded with "seed" so the recording can be replayed. */
+void movie_begin(movie_t *m, chip8_t *c, uint32_t seed, int cycles) {
+    memset(m, 0, sizeof(*m));
+    m->image = image_hash(c);
+    m->seed = seed;
+    m->cycles = cycles;
+    cpu_seed(c, seed);
+}
+
+/* Record the keys pressed on "c" for the next frame; call it once per
+ * frame, right before running the frame.
+ * Return -1 if there is no memory for it: the frame is not recorded, and
+ * the movie still holds the frames before it. */
+int movie_record(movie_t *m, chip8_t *c) {
+    uint16_t mask = keys_mask(c);
+    if ((m->nevents == 0 || m->events[m->nevents - 1].mask != mask) &&
+            add_event(m, m->frames, mask) < 0)
+        return -1;
+    m->frames++;
+    return 0;
+}
+
+/* Stop recording: "c" is in its final state. */
+void movie_end(movie_t *m, chip8_t *c) {
+    m->hash = cpu_hash(c);
+}
+
+void movie_free(movie_t *m) {
+    free(m->events);
+    memset(m, 0, sizeof(*m));
+}
+
+int movie_save(movie_t *m, FILE *f) {
+    fprintf(f, "chip8-movie %d\n", MOVIE_VERSION);
+    fprintf(f, "image %016llx\n", (unsigned long long)m->image);
+    fprintf(f, "seed %08x\n", m->seed);
+    fprintf(f, "cycles %d\n", m->cycles);
+    fprintf(f, "frames %d\n", m->frames);
+    fprintf(f, "hash %016llx\n", (unsigned long long)m->hash);
+    int i;
+    for (i = 0; i < m->nevents; i++)
+        fprintf(f, "%d %x\n", m->events[i].frame, m->events[i].mask);
+    return ferror(f) ? -1 : 0;
+}
+
+/* Read a movie from "f".
+ * Return 0 on success, -1 if it is not a movie of this version or if
+ * there is no memory for its events. */
+int movie_load(movie_t *m, FILE *f) {
+    memset(m, 0, sizeof(*m));
+    char line[256];
+    int version = 0;
+    if (!fgets(line, sizeof(line), f) ||
+            sscanf(line, "chip8-movie %d", &version) != 1 ||
+            version != MOVIE_VERSION)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long h;
+        unsigned u;
+        int n;
+        if (sscanf(line, "image %llx", &h) == 1)
+            m->image = h;
+        else if (sscanf(line, "seed %x", &u) == 1)
+            m->seed = u;
+        else if (sscanf(line, "cycles %d", &n) == 1)
+            m->cycles = n;
+        else if (sscanf(line, "frames %d", &n) == 1)
+            m->frames = n;
+        else if (sscanf(line, "hash %llx", &h) == 1)
+            m->hash = h;
+        else if (sscanf(line, "%d %x", &n, &u) == 2 &&
+                add_event(m, n, u) < 0) {
+            movie_free(m);
+            return -1;
+        }
+    }
+    if (m->cycles <= 0) {
+        movie_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+/* Replay the movie on "c", which must have just been reset and loaded
+ * with the image, as fast as possible.
+ * Return 0 if the final state matches the recording, 1 if it does not and
+ * -1 if "c" holds another image. */
+int movie_play(movie_t *m, chip8_t *c) {
+    if (image_hash(c) != m->image)
+        return -1;
+    cpu_seed(c, m->seed);
+
+    int next = 0;
+    int frame;
+    for (frame = 0; frame < m->frames; frame++) {
+        while (next < m->nevents && m->events[next].frame <= frame) {
+            int k;
+            for (k = 0; k < 16; k++)
+                c->keys[k] = (m->events[next].mask >> k) & 1;
+            next++;
+        }
+        cpu_tick_timers(c);
+        cpu_update(c, m->cycles);
+    }
+    return cpu_hash(c) == m->hash ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/* CHIP-8 CORPUS PACKER
+ *
+ * Packs images into a single archive that chip8-batch maps once and shares
+ * between all of its machines (see corpus.c). Every image is stored once,
+ * however many files hold it; each file name still finds it.
+ *
+ *      ./chip8-pack archive file...
+ *
+ * Names are stored as given on the command line, so a job list can refer
+ * to the same paths it would use without an archive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+static void out_of_memory() {
+    fprintf(stderr, "chip8: out of memory\n");
+    exit(1);
+}
+
+/* Read the whole file at "path" into a newly allocated buffer. */
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    size_t cap = 4096, n = 0;
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL)
+        out_of_memory();
+    size_t r;
+    while ((r = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += r;
+        if (n == cap && (buf = realloc(buf, cap *= 2)) == NULL)
+            out_of_memory();
+    }
+    fclose(f);
+    *size = n;
+    return buf;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ./chip8-pack archive file...\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3)
+        usage();
+    int n = argc - 2;
+    char **names = argv + 2;
+    const uint8_t **data = malloc(n * sizeof(uint8_t *));
+    size_t *sizes = malloc(n * sizeof(size_t));
+    if (data == NULL || sizes == NULL)
+        out_of_memory();
+    size_t total = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        data[i] = read_file(names[i], &sizes[i]);
+        if (!data[i]) {
+            fprintf(stderr, "chip8: error opening file (%s)\n", names[i]);
+            exit(1);
+        }
+        total += sizes[i];
+    }
+
+    FILE *f = fopen(argv[1], "wb");
+    if (!f) {
+        fprintf(stderr, "chip8: error writing archive (%s)\n", argv[1]);
+        exit(1);
+    }
+    int unique = corpus_write(f, names, data, sizes, n);
+    if (fclose(f) != 0 || unique < 0) {
+        fprintf(stderr, "chip8: cannot pack %s: image too large, name "
+                "repeated, out of memory or write error\n", argv[1]);
+        remove(argv[1]);
+        exit(1);
+    }
+    fprintf(stderr, "%d files, %d distinct images, %zu bytes of images\n",
+            n, unique, total);
+
+    for (i = 0; i < n; i++)
+        free((void *)data[i]);
+    free(data);
+    free(sizes);
+    return 0;
+}
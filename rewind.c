@@ -0,0 +1,193 @@
+/* Rewind: a bounded history of save states, one per recorded frame.
+ *
+ * Only the newest state is kept whole. Every older one is kept as the
+ * XOR of it and the state recorded after it, run-length encoded: between
+ * two frames only a few registers, timers and framebuffer rows change,
+ * so most of the XOR is zeros and a delta is usually tens of bytes.
+ *
+ * XOR deltas work both ways, so stepping back one frame is just applying
+ * the newest delta to the newest state: no keyframes, and the cost is
+ * one delta decode plus cpu_restore. When the ring is full, the oldest
+ * deltas are dropped; the history then simply starts later.
+ *
+ * Ring records: [length][delta][length], lengths as 32-bit integers so
+ * the ring can be walked from both ends. Delta encoding: a sequence of
+ * (skip: 16 bits, count: 8 bits, count XOR bytes) runs. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+/* Worst case delta: a run costs 3 bytes more than its XOR bytes and,
+ * unless it is the last or 255 long, is followed by at least two skipped
+ * bytes. One changed byte in every three thus costs 4 bytes for every 3,
+ * more than the whole state. */
+#define DELTA_MAX   (((STATE_SIZE + 2) / 3 + 1) * 4)
+#define RECORD_MAX  (DELTA_MAX + 8)
+
+struct rewind {
+    uint8_t *ring;
+    size_t   size;
+    size_t   start;         /* oldest record */
+    size_t   used;
+    int      frames;        /* deltas in the ring */
+    int      have_state;
+    uint8_t  state[STATE_SIZE];     /* newest recorded state */
+    uint8_t  next[STATE_SIZE];
+    uint8_t  delta[RECORD_MAX];
+};
+
+/* Create a history that uses about "size" bytes for deltas.
+ * Return NULL if "size" cannot hold even a single delta, or if there is
+ * no memory for it. */
+rewind_t *rewind_create(size_t size) {
+    if (size < RECORD_MAX)
+        return NULL;
+    rewind_t *r = calloc(1, sizeof(rewind_t));
+    if (r == NULL)
+        return NULL;
+    r->ring = malloc(size);
+    if (r->ring == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->size = size;
+    return r;
+}
+
+void rewind_free(rewind_t *r) {
+    if (r) {
+        free(r->ring);
+        free(r);
+    }
+}
+
+/* Forget the whole history, e.g. after loading another image. */
+void rewind_clear(rewind_t *r) {
+    r->start = r->used = 0;
+    r->frames = 0;
+    r->have_state = 0;
+}
+
+/* Number of frames the history can currently go back. */
+int rewind_frames(rewind_t *r) {
+    return r->frames;
+}
+
+/* Copy "n" bytes in and out of the ring, wrapping at its end. */
+static void ring_write(rewind_t *r, size_t pos, const uint8_t *src, size_t n) {
+    pos %= r->size;
+    size_t first = n < r->size - pos ? n : r->size - pos;
+    memcpy(r->ring + pos, src, first);
+    memcpy(r->ring, src + first, n - first);
+}
+
+static void ring_read(rewind_t *r, size_t pos, uint8_t *dst, size_t n) {
+    pos %= r->size;
+    size_t first = n < r->size - pos ? n : r->size - pos;
+    memcpy(dst, r->ring + pos, first);
+    memcpy(dst + first, r->ring, n - first);
+}
+
+static uint32_t ring_length(rewind_t *r, size_t pos) {
+    uint32_t n;
+    ring_read(r, pos, (uint8_t *)&n, sizeof(n));
+    return n;
+}
+
+/* Encode a ^ b into "out"; return its length. */
+static size_t delta_encode(const uint8_t *a, const uint8_t *b, uint8_t *out) {
+    uint8_t *p = out;
+    size_t i = 0, last = 0;
+    while (i < STATE_SIZE) {
+        /* Skip identical bytes, eight at a time while possible. */
+        while (i + 8 <= STATE_SIZE) {
+            uint64_t x, y;
+            memcpy(&x, a + i, 8);
+            memcpy(&y, b + i, 8);
+            if (x != y)
+                break;
+            i += 8;
+        }
+        while (i < STATE_SIZE && a[i] == b[i])
+            i++;
+        if (i == STATE_SIZE)
+            break;
+
+        /* A run of XOR bytes, up to 255, ending at the next two identical
+         * bytes (a single one costs less to keep than to skip). */
+        size_t n = 0;
+        while (i + n < STATE_SIZE && n < 255 &&
+                (a[i + n] != b[i + n] ||
+                 (i + n + 1 < STATE_SIZE && a[i + n + 1] != b[i + n + 1])))
+            n++;
+        size_t skip = i - last;
+        p[0] = skip;
+        p[1] = skip >> 8;
+        p[2] = n;
+        p += 3;
+        size_t k;
+        for (k = 0; k < n; k++)
+            *p++ = a[i + k] ^ b[i + k];
+        i += n;
+        last = i;
+    }
+    return p - out;
+}
+
+/* XOR the delta of length "n" into "state". */
+static void delta_apply(uint8_t *state, const uint8_t *delta, size_t n) {
+    const uint8_t *p = delta, *end = delta + n;
+    size_t i = 0;
+    while (p < end) {
+        i += p[0] | p[1] << 8;
+        size_t count = p[2];
+        p += 3;
+        while (count--)
+            state[i++] ^= *p++;
+    }
+}
+
+/* Drop the oldest delta. */
+static void drop_oldest(rewind_t *r) {
+    uint32_t n = ring_length(r, r->start);
+    r->start = (r->start + n + 8) % r->size;
+    r->used -= n + 8;
+    r->frames--;
+}
+
+/* Record the current state of "c" as the newest frame of the history. */
+void rewind_push(rewind_t *r, chip8_t *c) {
+    if (!r->have_state) {
+        cpu_save(c, r->state);
+        r->have_state = 1;
+        return;
+    }
+    cpu_save(c, r->next);
+    uint32_t n = delta_encode(r->state, r->next, r->delta);
+    while (r->used + n + 8 > r->size)
+        drop_oldest(r);
+
+    size_t end = r->start + r->used;
+    ring_write(r, end, (uint8_t *)&n, sizeof(n));
+    ring_write(r, end + 4, r->delta, n);
+    ring_write(r, end + 4 + n, (uint8_t *)&n, sizeof(n));
+    r->used += n + 8;
+    r->frames++;
+    memcpy(r->state, r->next, STATE_SIZE);
+}
+
+/* Go back one frame: restore "c" to the frame recorded before the newest
+ * one, which becomes the newest. Return -1 if there is no such frame. */
+int rewind_step(rewind_t *r, chip8_t *c) {
+    if (r->frames == 0)
+        return -1;
+    size_t end = r->start + r->used;
+    uint32_t n = ring_length(r, end - 4);
+    ring_read(r, end - 4 - n, r->delta, n);
+    delta_apply(r->state, r->delta, n);
+    r->used -= n + 8;
+    r->frames--;
+    return cpu_restore(c, r->state, STATE_SIZE);
+}
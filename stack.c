@@ -1,21 +1,31 @@
 /* Simple implementation of a stack */
 
-#include <assert.h>
 #include <string.h>
 #include "chip8.h"
+#include "stats.h"
 
-void stack_init() {
+void stack_init(chip8_t *c) {
     /* reset stack elements and stack pointer */
-    memset(stack, 0, LEVELS);
-    sp = 0;
+    memset(c->stack, 0, sizeof(c->stack));
+    c->sp = 0;
 }
 
-void stack_push(uint16_t address) {
-    assert(sp < LEVELS);
-    stack[sp++] = address;
+/* Push "address". Return 0, or -1 (leaving the stack alone) if the stack
+ * is full. */
+int stack_push(chip8_t *c, uint16_t address) {
+    if (c->sp >= LEVELS)
+        return -1;
+    c->stack[c->sp++] = address;
+    STATS_CALL(c, address);
+    return 0;
 }
 
-uint16_t stack_pop() {
-    assert(sp > 0);
-    return stack[--sp];
+/* Pop the last address pushed into "address". Return 0, or -1 if the
+ * stack is empty. */
+int stack_pop(chip8_t *c, uint16_t *address) {
+    if (c->sp == 0)
+        return -1;
+    STATS_RETURN(c);
+    *address = c->stack[--c->sp];
+    return 0;
 }
@@ -0,0 +1,138 @@
+/* Save states: the whole machine as a compact, versioned blob.
+ *
+ * Blob layout (STATE_SIZE bytes, multi-byte fields little-endian):
+ *
+ *      "C8S" version           4
+ *      memory                  4096
+ *      V0-VF                   16
+ *      I, PC                   2 + 2
+ *      delay, sound timers     1 + 1
+ *      framebuffer rows        32 * 8
+ *      keys                    16
+ *      stack, sp               12 * 2 + 2
+ *      rng state               4
+ *
+ * Decoded and compiled code is not part of the state: it is rebuilt from
+ * memory as needed. Neither saving nor restoring allocates anything. */
+
+#include <string.h>
+
+#include "chip8.h"
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, v);
+    return put16(p, v >> 16);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v) {
+    p = put32(p, v);
+    return put32(p, v >> 32);
+}
+
+static uint16_t get16(const uint8_t **p) {
+    uint16_t v = (*p)[0] | (*p)[1] << 8;
+    *p += 2;
+    return v;
+}
+
+static uint32_t get32(const uint8_t **p) {
+    uint32_t v = get16(p);
+    return v | (uint32_t)get16(p) << 16;
+}
+
+static uint64_t get64(const uint8_t **p) {
+    uint64_t v = get32(p);
+    return v | (uint64_t)get32(p) << 32;
+}
+
+/* Save the state of "c" to "buf", which must hold STATE_SIZE bytes.
+ * Return the number of bytes written. */
+size_t cpu_save(chip8_t *c, uint8_t *buf) {
+    uint8_t *p = buf;
+    int i;
+
+    *p++ = 'C'; *p++ = '8'; *p++ = 'S'; *p++ = STATE_VERSION;
+    memcpy(p, c->memory, sizeof(c->memory));
+    p += sizeof(c->memory);
+    memcpy(p, c->reg, sizeof(c->reg));
+    p += sizeof(c->reg);
+    p = put16(p, c->reg_I);
+    p = put16(p, c->reg_PC);
+    *p++ = c->timer_delay;
+    *p++ = c->timer_sound;
+    for (i = 0; i < HEIGHT; i++)
+        p = put64(p, c->frame_buffer[i]);
+    memcpy(p, c->keys, sizeof(c->keys));
+    p += sizeof(c->keys);
+    for (i = 0; i < LEVELS; i++)
+        p = put16(p, c->stack[i]);
+    p = put16(p, c->sp);
+    p = put32(p, c->rng);
+    return p - buf;
+}
+
+/* Restore the state saved in "buf" to "c".
+ * Return 0 on success or -1 if "buf" is not a valid state of this version;
+ * "c" is left untouched in that case. */
+int cpu_restore(chip8_t *c, const uint8_t *buf, size_t size) {
+    const uint8_t *p = buf;
+    int i;
+
+    if (size != STATE_SIZE || memcmp(p, "C8S", 3) != 0 ||
+            p[3] != STATE_VERSION)
+        return -1;
+    /* A stack pointer out of range would make 2NNN/00EE overrun the stack. */
+    const uint8_t *q = buf + STATE_SIZE - 4 - 2;
+    if (get16(&q) > LEVELS)
+        return -1;
+    /* Nor can the random number generator be 0: xorshift would stay
+     * there, and every CXNN would give 0 from then on. */
+    if (get32(&q) == 0)
+        return -1;
+    p += 4;
+
+    /* Decoded code only needs to go where memory actually changes; when
+     * branching off the same program over and over, that is just data.
+     * Compare memory in 64-byte chunks and invalidate the chunks that
+     * differ. */
+    uint64_t changed = 0;
+    for (i = 0; i < 64; i++)
+        if (memcmp(&c->memory[i * 64], p + i * 64, 64) != 0)
+            changed |= 1ULL << i;
+    if (changed) {
+        memcpy(c->memory, p, sizeof(c->memory));
+        /* This is not self-modifying code: don't keep interpreting the
+         * replaced code forever, just translate it again. */
+        if (c->jit)
+            jit_reload(c, changed);
+        for (i = 0; i < 64; i++)
+            if (changed & (1ULL << i))
+                cpu_invalidate(c, i * 64, 64);
+    }
+    p += sizeof(c->memory);
+
+    memcpy(c->reg, p, sizeof(c->reg));
+    p += sizeof(c->reg);
+    c->reg_I = get16(&p);
+    c->reg_PC = get16(&p);
+    c->timer_delay = *p++;
+    c->timer_sound = *p++;
+    for (i = 0; i < HEIGHT; i++)
+        c->frame_buffer[i] = get64(&p);
+    c->dirty = 1;
+    memcpy(c->keys, p, sizeof(c->keys));
+    p += sizeof(c->keys);
+    for (i = 0; i < LEVELS; i++)
+        c->stack[i] = get16(&p);
+    c->sp = get16(&p);
+    c->rng = get32(&p);
+    /* Faults are not part of the state: the restored machine has not run
+     * into any yet. */
+    c->fault = FAULT_NONE;
+    return 0;
+}
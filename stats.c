@@ -0,0 +1,286 @@
+/* Execution counters: how often every instruction and every address ran,
+ * instructions per frame and time the frontend spent sleeping.
+ *
+ * They also include a guest call graph. stack_push and stack_pop report
+ * every 2NNN and 00EE, and the instructions run since the previous call
+ * or return are charged to the subroutine that was running. This gives
+ * exclusive and inclusive cost per call path, which can be dumped as
+ * folded stacks for flamegraph.pl, and per call site.
+ *
+ * The engines only count when built with -DCHIP8_STATS (make STATS=1);
+ * the JIT engine then interprets, since compiled blocks do not count.
+ * Counting is per machine and starts with stats_enable. */
+
+#include <string.h>
+
+#include "stats.h"
+
+/* Instruction names, by instruction id. */
+static const char *names[NOPS] = {
+    [OP_INVALID] = "invalid", [OP_DECODE] = "decode",
+    [OP_00E0] = "00E0", [OP_00EE] = "00EE", [OP_1NNN] = "1NNN",
+    [OP_2NNN] = "2NNN", [OP_3XNN] = "3XNN", [OP_4XNN] = "4XNN",
+    [OP_5XY0] = "5XY0", [OP_6XNN] = "6XNN", [OP_7XNN] = "7XNN",
+    [OP_8XY0] = "8XY0", [OP_8XY1] = "8XY1", [OP_8XY2] = "8XY2",
+    [OP_8XY3] = "8XY3", [OP_8XY4] = "8XY4", [OP_8XY5] = "8XY5",
+    [OP_8XY6] = "8XY6", [OP_8XY7] = "8XY7", [OP_8XYE] = "8XYE",
+    [OP_9XY0] = "9XY0", [OP_ANNN] = "ANNN", [OP_BNNN] = "BNNN",
+    [OP_CXNN] = "CXNN", [OP_DXYN] = "DXYN", [OP_EX9E] = "EX9E",
+    [OP_EXA1] = "EXA1", [OP_FX07] = "FX07", [OP_FX0A] = "FX0A",
+    [OP_FX15] = "FX15", [OP_FX18] = "FX18", [OP_FX1E] = "FX1E",
+    [OP_FX29] = "FX29", [OP_FX33] = "FX33", [OP_FX55] = "FX55",
+    [OP_FX65] = "FX65",
+};
+
+/* Start counting on "c". Return 0, or -1 if the counters were not
+ * compiled in or there is no memory for them. */
+int stats_enable(chip8_t *c) {
+#ifdef CHIP8_STATS
+    if (c->stats == NULL) {
+        struct stats *s = calloc(1, sizeof(struct stats));
+        if (s == NULL)
+            return -1;
+        s->capacity = 64;
+        s->nodes = calloc(s->capacity, sizeof(prof_node_t));
+        if (s->nodes == NULL) {
+            free(s);
+            return -1;
+        }
+        s->nodes[0] = (prof_node_t){ .parent = -1, .child = -1,
+            .sibling = -1, .target = 0x200 };
+        s->nnodes = 1;
+        c->stats = s;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void stats_free(chip8_t *c) {
+    if (c->stats)
+        free(c->stats->nodes);
+    free(c->stats);
+    c->stats = NULL;
+}
+
+/* End of a frame: account the instructions it ran. */
+void stats_frame(chip8_t *c) {
+    struct stats *s = c->stats;
+    uint64_t n = s->instructions - s->frame_start;
+    if (s->frames == 0 || n < s->frame_min)
+        s->frame_min = n;
+    if (n > s->frame_max)
+        s->frame_max = n;
+    s->frames++;
+    s->frame_start = s->instructions;
+}
+
+/* Charge the instructions run since the last call or return to the
+ * subroutine running now. */
+static void charge(struct stats *s) {
+    s->nodes[s->current].self += s->instructions - s->charged;
+    s->charged = s->instructions;
+}
+
+/* A 2NNN pushed return address "ret": enter the subroutine it calls. */
+void stats_call(chip8_t *c, uint16_t ret) {
+    struct stats *s = c->stats;
+    charge(s);
+    /* Calls made from one that was not entered are not entered either. */
+    if (s->lost > 0) {
+        s->lost++;
+        return;
+    }
+
+    /* The target is in the call instruction itself, right before the
+     * return address; PC does not point at it yet. */
+    uint16_t site = (ret - 2) & 0xFFF;
+    uint16_t target = cpu_fetch(c, site) & 0xFFF;
+
+    int n;
+    for (n = s->nodes[s->current].child; n >= 0; n = s->nodes[n].sibling)
+        if (s->nodes[n].site == site && s->nodes[n].target == target)
+            break;
+    if (n < 0) {
+        if (s->nnodes == s->capacity) {
+            prof_node_t *nodes = realloc(s->nodes,
+                    2 * s->capacity * sizeof(prof_node_t));
+            /* No memory for another node: the subroutine is charged to
+             * its caller, until it returns. */
+            if (nodes == NULL) {
+                s->lost++;
+                return;
+            }
+            s->nodes = nodes;
+            s->capacity *= 2;
+        }
+        n = s->nnodes++;
+        s->nodes[n] = (prof_node_t){ .parent = s->current, .child = -1,
+            .sibling = s->nodes[s->current].child, .site = site,
+            .target = target };
+        s->nodes[s->current].child = n;
+    }
+    s->nodes[n].calls++;
+    s->current = n;
+}
+
+/* A 00EE popped the stack: back to the caller. */
+void stats_return(chip8_t *c) {
+    struct stats *s = c->stats;
+    charge(s);
+    if (s->lost > 0) {
+        s->lost--;
+        return;
+    }
+    /* A return without a matching call (the stack was restored, or the
+     * program plays tricks with it) stays in the main program. */
+    if (s->current != 0)
+        s->current = s->nodes[s->current].parent;
+}
+
+/* Compute the inclusive cost of every node. Callees are always created
+ * after their caller, so walking backwards adds every node to its parent
+ * after the node itself is complete. */
+static void prof_totals(struct stats *s) {
+    int i;
+    charge(s);
+    for (i = 0; i < s->nnodes; i++)
+        s->nodes[i].total = s->nodes[i].self;
+    for (i = s->nnodes - 1; i > 0; i--)
+        s->nodes[s->nodes[i].parent].total += s->nodes[i].total;
+}
+
+/* Return 1 if an ancestor of node "n" was called from the same site:
+ * its cost is already in that ancestor's inclusive cost (recursion). */
+static int prof_nested(struct stats *s, int n) {
+    int p;
+    for (p = s->nodes[n].parent; p > 0; p = s->nodes[p].parent)
+        if (s->nodes[p].site == s->nodes[n].site &&
+                s->nodes[p].target == s->nodes[n].target)
+            return 1;
+    return 0;
+}
+
+/* Write the call graph to "f" as folded stacks, one line per call path
+ * with its exclusive cost: "main;sub_2a0;sub_31c 1234". Paths deeper
+ * than LEVELS keep their innermost LEVELS calls, after a "..." frame
+ * standing for the ones left out. */
+void stats_folded(chip8_t *c, FILE *f) {
+    struct stats *s = c->stats;
+    if (s == NULL)
+        return;
+    charge(s);
+    int i, path[LEVELS + 1];
+    for (i = 0; i < s->nnodes; i++) {
+        if (s->nodes[i].self == 0)
+            continue;
+        int depth = 0, n;
+        for (n = i; n > 0 && depth < LEVELS; n = s->nodes[n].parent)
+            path[depth++] = n;
+        fprintf(f, n > 0 ? "main;..." : "main");
+        while (depth--)
+            fprintf(f, ";sub_%03x", s->nodes[path[depth]].target);
+        fprintf(f, " %llu\n", (unsigned long long)s->nodes[i].self);
+    }
+}
+
+/* Cost of one call site: every call path through it, added up. */
+typedef struct {
+    uint16_t site, target;
+    uint64_t calls, inclusive, exclusive;
+} site_t;
+
+/* Add up the nodes per call site into "sites"; return how many there are. */
+static int prof_sites(struct stats *s, site_t *sites) {
+    int i, j, n = 0;
+    prof_totals(s);
+    for (i = 1; i < s->nnodes; i++) {
+        prof_node_t *p = &s->nodes[i];
+        for (j = 0; j < n; j++)
+            if (sites[j].site == p->site && sites[j].target == p->target)
+                break;
+        if (j == n)
+            sites[n++] = (site_t){ .site = p->site, .target = p->target };
+        sites[j].calls += p->calls;
+        sites[j].exclusive += p->self;
+        if (!prof_nested(s, i))
+            sites[j].inclusive += p->total;
+    }
+    return n;
+}
+
+/* The frontend slept "seconds" waiting for the next frame. */
+void stats_idle(chip8_t *c, double seconds) {
+    if (c->stats)
+        c->stats->idle += seconds;
+}
+
+/* Write the counters to "f" as CSV (kind,key,count lines) or JSON;
+ * instructions and addresses that never ran are left out. */
+void stats_dump(chip8_t *c, FILE *f, int json) {
+    struct stats *s = c->stats;
+    if (s == NULL)
+        return;
+    double mean = s->frames ? (double)s->instructions / s->frames : 0;
+    int i, n;
+    site_t *sites = malloc(s->nnodes * sizeof(site_t));
+    /* Without memory for them, call sites are left out. */
+    int nsites = sites ? prof_sites(s, sites) : 0;
+
+    if (!json) {
+        fprintf(f, "kind,key,count\n");
+        fprintf(f, "total,instructions,%llu\n", (unsigned long long)s->instructions);
+        fprintf(f, "total,frames,%llu\n", (unsigned long long)s->frames);
+        fprintf(f, "frame,min,%llu\n", (unsigned long long)s->frame_min);
+        fprintf(f, "frame,max,%llu\n", (unsigned long long)s->frame_max);
+        fprintf(f, "frame,mean,%.2f\n", mean);
+        fprintf(f, "idle,seconds,%.6f\n", s->idle);
+        for (i = 0; i < NOPS; i++)
+            if (s->op[i])
+                fprintf(f, "op,%s,%llu\n", names[i], (unsigned long long)s->op[i]);
+        for (i = 0; i < 0x1000; i++)
+            if (s->pc[i])
+                fprintf(f, "pc,%03x,%llu\n", i, (unsigned long long)s->pc[i]);
+        /* call sites as "site>subroutine" */
+        for (i = 0; i < nsites; i++) {
+            fprintf(f, "calls,%03x>%03x,%llu\n", sites[i].site, sites[i].target,
+                    (unsigned long long)sites[i].calls);
+            fprintf(f, "inclusive,%03x>%03x,%llu\n", sites[i].site, sites[i].target,
+                    (unsigned long long)sites[i].inclusive);
+            fprintf(f, "exclusive,%03x>%03x,%llu\n", sites[i].site, sites[i].target,
+                    (unsigned long long)sites[i].exclusive);
+        }
+        free(sites);
+        return;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"instructions\": %llu,\n", (unsigned long long)s->instructions);
+    fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)s->frames);
+    fprintf(f, "  \"per_frame\": { \"min\": %llu, \"max\": %llu, \"mean\": %.2f },\n",
+            (unsigned long long)s->frame_min, (unsigned long long)s->frame_max, mean);
+    fprintf(f, "  \"idle_seconds\": %.6f,\n", s->idle);
+    fprintf(f, "  \"ops\": {");
+    for (i = 0, n = 0; i < NOPS; i++)
+        if (s->op[i])
+            fprintf(f, "%s\n    \"%s\": %llu", n++ ? "," : "", names[i],
+                    (unsigned long long)s->op[i]);
+    fprintf(f, "\n  },\n");
+    fprintf(f, "  \"pcs\": {");
+    for (i = 0, n = 0; i < 0x1000; i++)
+        if (s->pc[i])
+            fprintf(f, "%s\n    \"%03x\": %llu", n++ ? "," : "", i,
+                    (unsigned long long)s->pc[i]);
+    fprintf(f, "\n  },\n");
+    fprintf(f, "  \"call_sites\": [");
+    for (i = 0; i < nsites; i++)
+        fprintf(f, "%s\n    { \"site\": \"%03x\", \"target\": \"%03x\", "
+                "\"calls\": %llu, \"inclusive\": %llu, \"exclusive\": %llu }",
+                i ? "," : "", sites[i].site, sites[i].target,
+                (unsigned long long)sites[i].calls,
+                (unsigned long long)sites[i].inclusive,
+                (unsigned long long)sites[i].exclusive);
+    fprintf(f, "\n  ]\n}\n");
+    free(sites);
+}
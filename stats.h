@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* Execution counters, compiled in only with -DCHIP8_STATS (make STATS=1);
+ * without it, STATS_INSTR and STATS_FRAME expand to nothing and the
+ * engines are exactly the same as before. */
+
+#include "chip8.h"
+#include "instr.h"
+
+/* Call graph node: one subroutine, as reached through one call path. */
+typedef struct {
+    int      parent;
+    int      child;             /* first callee, -1 if none */
+    int      sibling;           /* next callee of the parent, -1 if none */
+    uint16_t site;              /* address of the 2NNN that called it */
+    uint16_t target;            /* address of the subroutine */
+    uint64_t calls;
+    uint64_t self;              /* instructions run in it, callees excluded */
+    uint64_t total;             /* callees included; computed on dump */
+} prof_node_t;
+
+struct stats {
+    uint64_t op[NOPS];          /* executions per instruction id */
+    uint64_t pc[0x1000];        /* executions per address */
+    uint64_t instructions;
+
+    /* instructions per frame (ended by cpu_frame) */
+    uint64_t frames;
+    uint64_t frame_min, frame_max;
+    uint64_t frame_start;       /* instructions when the frame started */
+
+    double   idle;              /* seconds the frontend slept */
+
+    /* Call graph, node 0 being the main program; instructions are charged
+     * to the current node on every call and return. */
+    prof_node_t *nodes;
+    int      nnodes;
+    int      capacity;
+    int      current;
+    int      lost;              /* calls not entered for lack of memory */
+    uint64_t charged;           /* instructions charged so far */
+};
+
+#ifdef CHIP8_STATS
+#define STATS_INSTR(c, id, pc)                      \
+    do {                                            \
+        if ((c)->stats) {                           \
+            (c)->stats->op[id]++;                   \
+            (c)->stats->pc[(pc) & 0xFFF]++;         \
+            (c)->stats->instructions++;             \
+        }                                           \
+    } while (0)
+#define STATS_FRAME(c)                              \
+    do {                                            \
+        if ((c)->stats)                             \
+            stats_frame(c);                         \
+    } while (0)
+#define STATS_CALL(c, ret)                          \
+    do {                                            \
+        if ((c)->stats)                             \
+            stats_call((c), (ret));                 \
+    } while (0)
+#define STATS_RETURN(c)                             \
+    do {                                            \
+        if ((c)->stats)                             \
+            stats_return(c);                        \
+    } while (0)
+#else
+#define STATS_INSTR(c, id, pc)  do { } while (0)
+#define STATS_FRAME(c)          do { } while (0)
+#define STATS_CALL(c, ret)      do { } while (0)
+#define STATS_RETURN(c)         do { } while (0)
+#endif
+
+void stats_frame(chip8_t *c);
+void stats_call(chip8_t *c, uint16_t ret);
+void stats_return(chip8_t *c);
+
+#endif
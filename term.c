@@ -0,0 +1,100 @@
+/* Terminal rendering: the screen drawn with ANSI escape sequences, for
+ * watching a machine over a slow link.
+ *
+ * Each character cell shows two rows of pixels as a half block (upper,
+ * lower, full or none), so the whole screen takes 64x16 cells, and pixels
+ * need no color attributes at all. The renderer remembers what the
+ * terminal shows and only redraws the cells that changed since: moving
+ * the cursor to a cell costs an escape sequence, so runs of unchanged
+ * cells between two changes on a line are either skipped or written over
+ * again, whichever is shorter. A frame that did not change writes
+ * nothing. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define ROWS    (HEIGHT / 2)
+
+/* Half blocks in UTF-8, by the pixels they show: bit 1 is the upper row,
+ * bit 0 the lower one. */
+static const char *glyphs[4] = { " ", "\xe2\x96\x84", "\xe2\x96\x80", "\xe2\x96\x88" };
+static const int glyph_size[4] = { 1, 3, 3, 3 };
+
+/* Pixels of the cell at "col" on line "line" of "rows". */
+static int cell(const uint64_t *rows, int line, int col) {
+    int shift = WIDTH - 1 - col;
+    return (int)((rows[2 * line] >> shift) & 1) << 1 |
+        (int)((rows[2 * line + 1] >> shift) & 1);
+}
+
+/* Start over: the next term_draw clears the terminal and draws it all. */
+void term_init(term_t *t) {
+    t->valid = 0;
+}
+
+/* Bring the terminal up to date with the screen of "c", writing to "f".
+ * Return the number of bytes written. */
+size_t term_draw(term_t *t, chip8_t *c, FILE *f) {
+    /* Worst case: a cursor move and a glyph for every cell. */
+    char buf[16 + ROWS * WIDTH * 12];
+    size_t n = 0;
+    int line, col;
+    if (!t->valid) {
+        /* A cleared terminal shows a blank screen: draw everything else
+         * as changes from it. */
+        n += sprintf(buf, "\x1b[2J\x1b[?25l");
+        memset(t->shown, 0, sizeof(t->shown));
+        t->valid = 1;
+    }
+
+    for (line = 0; line < ROWS; line++) {
+        uint64_t changed = (t->shown[2 * line] ^ c->frame_buffer[2 * line]) |
+            (t->shown[2 * line + 1] ^ c->frame_buffer[2 * line + 1]);
+        /* Column the cursor is at on this line, -1 if elsewhere. */
+        int cursor = -1;
+        while (changed) {
+            col = __builtin_clzll(changed);
+            changed &= ~(1ULL << (WIDTH - 1 - col));
+            /* Rewrite the cells up to this one if that is shorter than
+             * moving the cursor past them. */
+            int gap = 0, k;
+            if (cursor < 0) {
+                n += sprintf(buf + n, "\x1b[%d;%dH", line + 1, col + 1);
+            } else if (col > cursor) {
+                for (k = cursor; k < col; k++)
+                    gap += glyph_size[cell(c->frame_buffer, line, k)];
+                if (gap > 4 + (col - cursor > 9)) {
+                    n += sprintf(buf + n, "\x1b[%dC", col - cursor);
+                } else {
+                    for (k = cursor; k < col; k++) {
+                        int g = cell(c->frame_buffer, line, k);
+                        memcpy(buf + n, glyphs[g], glyph_size[g]);
+                        n += glyph_size[g];
+                    }
+                }
+            }
+            int g = cell(c->frame_buffer, line, col);
+            memcpy(buf + n, glyphs[g], glyph_size[g]);
+            n += glyph_size[g];
+            /* Past the last column, where the cursor goes is up to the
+             * terminal. */
+            cursor = col + 1 < WIDTH ? col + 1 : -1;
+        }
+        t->shown[2 * line] = c->frame_buffer[2 * line];
+        t->shown[2 * line + 1] = c->frame_buffer[2 * line + 1];
+    }
+    if (n > 0) {
+        fwrite(buf, 1, n, f);
+        fflush(f);
+    }
+    return n;
+}
+
+/* Leave the terminal usable again: cursor shown, below the screen. */
+void term_end(term_t *t, FILE *f) {
+    fprintf(f, "\x1b[%d;1H\x1b[?25h", ROWS + 1);
+    fflush(f);
+    t->valid = 0;
+}
@@ -0,0 +1,230 @@
+/* Threaded-code execution engine.
+ *
+ * Same decode cache and same semantics as cpu_update, but instead of
+ * calling the handler of every instruction, each instruction body jumps
+ * straight to the body of the next one through a table of labels
+ * (computed goto). Every instruction has its own indirect jump, which the
+ * branch predictor can learn separately, and the small instructions are
+ * inlined here instead of being called from instr.c.
+ *
+ * Compilers without computed goto (or builds with -DTHREADED_SWITCH) get
+ * a switch on the instruction id instead. */
+
+#include "chip8.h"
+#include "instr.h"
+#include "stats.h"
+
+#if defined(__GNUC__) && !defined(THREADED_SWITCH)
+#define THREADED_GOTO
+#endif
+
+/* Same fetch as cpu_update: even addresses come from the decode cache,
+ * odd ones are decoded every time. */
+#define FETCH()                                             \
+    do {                                                    \
+        if (cycles-- <= 0)                                  \
+            goto done;                                      \
+        if ((pc & 0xF001) == 0)                             \
+            in = &c->dcache[pc >> 1];                       \
+        else                                                \
+            in = decode_odd(c, pc, &odd);                   \
+        STATS_INSTR(c, in->id, pc);                         \
+        pc = pc + 2;                                        \
+    } while (0)
+
+/* With computed goto, every instruction body ends with its own copy of
+ * fetch and dispatch; that is the whole point of the engine, so the
+ * Makefile also keeps GCC from merging those copies back together. */
+#ifdef THREADED_GOTO
+#define CASE(id)    L_##id
+#define NEXT        do { FETCH(); goto *labels[in->id]; } while (0)
+#else
+#define CASE(id)    case id
+#define NEXT        continue
+#endif
+
+/* Continue at "target". A jump backwards from the instruction that just
+ * ran (which ends at "pc") may close an idle loop: see cpu_idle. */
+#define JUMP(target)                            \
+    do {                                        \
+        uint16_t from = pc;                     \
+        pc = (target);                          \
+        if (pc < from && --c->idle_countdown <= 0) { \
+            c->reg_PC = pc;                     \
+            cycles -= cpu_idle(c, cycles);      \
+        }                                       \
+    } while (0)
+
+/* Run an instruction that is not inlined: hand PC over to its handler
+ * and take it back afterwards (FX0A jumps to itself while waiting). */
+#define CALL()                      \
+    do {                            \
+        c->reg_PC = pc;             \
+        in->op(c, in);              \
+        JUMP(c->reg_PC);            \
+    } while (0)
+
+static const instr_t *decode_odd(chip8_t *c, uint16_t pc, instr_t *odd) {
+    cpu_decode(cpu_fetch(c, pc), odd);
+    return odd;
+}
+
+void cpu_update_threaded(chip8_t *c, int cycles) {
+#ifdef THREADED_GOTO
+    static void *labels[NOPS] = {
+        [OP_INVALID] = &&L_OP_INVALID,  [OP_DECODE] = &&L_OP_DECODE,
+        [OP_00E0] = &&L_OP_00E0,        [OP_00EE] = &&L_OP_00EE,
+        [OP_1NNN] = &&L_OP_1NNN,        [OP_2NNN] = &&L_OP_2NNN,
+        [OP_3XNN] = &&L_OP_3XNN,        [OP_4XNN] = &&L_OP_4XNN,
+        [OP_5XY0] = &&L_OP_5XY0,        [OP_6XNN] = &&L_OP_6XNN,
+        [OP_7XNN] = &&L_OP_7XNN,        [OP_8XY0] = &&L_OP_8XY0,
+        [OP_8XY1] = &&L_OP_8XY1,        [OP_8XY2] = &&L_OP_8XY2,
+        [OP_8XY3] = &&L_OP_8XY3,        [OP_8XY4] = &&L_OP_8XY4,
+        [OP_8XY5] = &&L_OP_8XY5,        [OP_8XY6] = &&L_OP_8XY6,
+        [OP_8XY7] = &&L_OP_8XY7,        [OP_8XYE] = &&L_OP_8XYE,
+        [OP_9XY0] = &&L_OP_9XY0,        [OP_ANNN] = &&L_OP_ANNN,
+        [OP_BNNN] = &&L_OP_BNNN,        [OP_CXNN] = &&L_OP_CXNN,
+        [OP_DXYN] = &&L_OP_DXYN,        [OP_EX9E] = &&L_OP_EX9E,
+        [OP_EXA1] = &&L_OP_EXA1,        [OP_FX07] = &&L_OP_FX07,
+        [OP_FX0A] = &&L_OP_FX0A,        [OP_FX15] = &&L_OP_FX15,
+        [OP_FX18] = &&L_OP_FX18,        [OP_FX1E] = &&L_OP_FX1E,
+        [OP_FX29] = &&L_OP_FX29,        [OP_FX33] = &&L_OP_FX33,
+        [OP_FX55] = &&L_OP_FX55,        [OP_FX65] = &&L_OP_FX65,
+    };
+#endif
+    uint8_t *reg = c->reg;
+    uint16_t pc = c->reg_PC;
+    const instr_t *in;
+    instr_t odd;
+    uint8_t prevx;
+    int i;
+
+#ifdef THREADED_GOTO
+    NEXT;
+#else
+    for (;;) {
+    FETCH();
+    switch (in->id) {
+#endif
+    CASE(OP_1NNN):
+        /* Jumps below 0x200 fault: leave them to the handler. */
+        if (in->nnn < 0x200) {
+            CALL();
+            NEXT;
+        }
+        JUMP(in->nnn);
+        NEXT;
+    CASE(OP_3XNN):
+        if (reg[in->x] == in->nn)
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_4XNN):
+        if (reg[in->x] != in->nn)
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_5XY0):
+        if (reg[in->x] == reg[in->y])
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_6XNN):
+        reg[in->x] = in->nn;
+        NEXT;
+    CASE(OP_7XNN):
+        reg[in->x] = reg[in->x] + in->nn;
+        NEXT;
+    CASE(OP_8XY0):
+        reg[in->x] = reg[in->y];
+        NEXT;
+    CASE(OP_8XY1):
+        reg[in->x] = reg[in->x] | reg[in->y];
+        NEXT;
+    CASE(OP_8XY2):
+        reg[in->x] = reg[in->x] & reg[in->y];
+        NEXT;
+    CASE(OP_8XY3):
+        reg[in->x] = reg[in->x] ^ reg[in->y];
+        NEXT;
+    CASE(OP_8XY4):
+        prevx = reg[in->x];
+        reg[in->x] = reg[in->x] + reg[in->y];
+        reg[0xF] = (reg[in->x] < prevx) ? 0x1 : 0x0;
+        NEXT;
+    CASE(OP_8XY5):
+        reg[0xF] = (reg[in->y] > reg[in->x]) ? 0x0 : 0x1;
+        reg[in->x] = reg[in->x] - reg[in->y];
+        NEXT;
+    CASE(OP_8XY6):
+        reg[0xF] = reg[in->x] & 0x1;
+        reg[in->x] = reg[in->x] >> 1;
+        NEXT;
+    CASE(OP_8XY7):
+        reg[0xF] = (reg[in->x] > reg[in->y]) ? 0x0 : 0x1;
+        reg[in->x] = reg[in->y] - reg[in->x];
+        NEXT;
+    CASE(OP_8XYE):
+        reg[0xF] = reg[in->x] >> 7;
+        reg[in->x] = reg[in->x] << 1;
+        NEXT;
+    CASE(OP_9XY0):
+        if (reg[in->x] != reg[in->y])
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_ANNN):
+        c->reg_I = in->nnn;
+        NEXT;
+    CASE(OP_BNNN):
+        JUMP(in->nnn + reg[0]);
+        NEXT;
+    CASE(OP_EX9E):
+        c->keys_seen |= 1 << (reg[in->x] & 0xF);
+        if (c->keys[reg[in->x] & 0xF] == 1)
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_EXA1):
+        c->keys_seen |= 1 << (reg[in->x] & 0xF);
+        if (c->keys[reg[in->x] & 0xF] == 0)
+            pc = pc + 2;
+        NEXT;
+    CASE(OP_FX07):
+        reg[in->x] = c->timer_delay;
+        NEXT;
+    CASE(OP_FX15):
+        c->timer_delay = reg[in->x];
+        NEXT;
+    CASE(OP_FX18):
+        c->timer_sound = reg[in->x];
+        NEXT;
+    CASE(OP_FX1E):
+        c->reg_I = c->reg_I + reg[in->x];
+        NEXT;
+    CASE(OP_FX29):
+        c->reg_I = FONT + reg[in->x] * 5;
+        NEXT;
+    CASE(OP_FX65):
+        for (i = 0; i <= in->x; i++)
+            reg[i] = c->memory[(c->reg_I + i) & 0xFFF];
+        c->reg_I = c->reg_I + in->x + 1;
+        NEXT;
+
+    /* Everything else is either too large to be worth inlining or touches
+     * the stack, the screen or the decode cache: use the handlers. */
+    CASE(OP_INVALID):
+    CASE(OP_DECODE):
+    CASE(OP_00E0):
+    CASE(OP_00EE):
+    CASE(OP_2NNN):
+    CASE(OP_CXNN):
+    CASE(OP_DXYN):
+    CASE(OP_FX0A):
+    CASE(OP_FX33):
+    CASE(OP_FX55):
+        CALL();
+        NEXT;
+#ifndef THREADED_GOTO
+    }
+    }
+#endif
+
+done:
+    c->reg_PC = pc;
+}
@@ -0,0 +1,53 @@
+/* Helpers the programs share: a clock, and the files that go with an
+ * image or that the command line asks for. Like the rest of the library,
+ * they leave reporting errors to the caller. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+double time_getseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (double) ((double)t.tv_sec + (double)t.tv_nsec / 1e9);
+}
+
+/* Decode the program ahead of time if its image was analyzed with
+ * chip8-analyze -w (into "path".cfg); "c" must have just been loaded from
+ * "path". Return -1 if the analysis is there but of another image, or
+ * cannot be loaded. */
+int load_analysis(chip8_t *c, const char *path) {
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.cfg", path);
+    FILE *f = fopen(name, "r");
+    if (!f)
+        return 0;
+    cfg_t g;
+    int r = cfg_load(&g, f) < 0 || cfg_apply(&g, c) < 0 ? -1 : 0;
+    cfg_free(&g);
+    fclose(f);
+    return r;
+}
+
+/* Write the execution counters of "c" to "path": JSON if its name ends in
+ * ".json", CSV otherwise. Return -1 if the file cannot be written. */
+int write_stats(chip8_t *c, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    size_t n = strlen(path);
+    stats_dump(c, f, n >= 5 && strcmp(path + n - 5, ".json") == 0);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* Write the guest call graph of "c" to "path" as folded stacks. Return -1
+ * if the file cannot be written. */
+int write_profile(chip8_t *c, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    stats_folded(c, f);
+    return fclose(f) == 0 ? 0 : -1;
+}